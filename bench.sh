@@ -0,0 +1,85 @@
+#!/bin/sh
+# This software is released as-is into the public domain, as described at
+# https://unlicense.org. Do whatever you like with it.
+#
+# See https://github.com/glitchub/i2cio for more information.
+
+# Benchmark i2cio parsing, read data formatting, and end-to-end throughput
+# against the simulated bus, using generated scripts of various shapes.
+# Results are written to stdout as one JSON object per line.
+#
+# Usage: bench.sh [path/to/i2cio]
+
+set -e
+
+i2cio=${1:-./i2cio}
+[ -x "$i2cio" ] || { echo "No $i2cio" >&2; exit 1; }
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# simulated devices, an EEPROM on each of 4 buses with no bus or write cycle time
+sim=24c02:0:0x50,24c02:1:0x51,24c02:2:0x52,24c02:3:0x53,cycle=0
+
+# many small transactions
+awk 'BEGIN { print "D 0x50 0"; for (i = 0; i < 200000; i++) printf "W 0x%02X R 4 ;\n", i % 256 }' > $dir/small
+
+# few huge writes
+awk 'BEGIN { print "D 0x50 0"; for (i = 0; i < 4000; i++) { printf "W"; for (j = 0; j < 256; j++) printf " 0x%02X", (i + j) % 256; print " ;" } }' > $dir/huge
+
+# the same huge writes as hex strings
+awk 'BEGIN { print "D 0x50 0"; for (i = 0; i < 4000; i++) { printf "W x\""; for (j = 0; j < 256; j++) printf "%02X", (i + j) % 256; print "\" ;" } }' > $dir/hex
+
+# device switch for every transaction
+awk 'BEGIN { for (i = 0; i < 200000; i++) printf "D 0x%02X %d W 0 R 1 ;\n", 80 + i % 4, i % 4 }' > $dir/switch
+
+# mostly comments
+awk 'BEGIN { print "D 0x50 0"; for (i = 0; i < 100000; i++) { print "# set register " i % 256 " to something, with a longish comment to skip"; printf "W %d ; # and another\n", i % 256 } }' > $dir/comment
+
+# large reads for output formatting
+awk 'BEGIN { print "D 0x50 0"; for (i = 0; i < 20000; i++) print "R 256 ;" }' > $dir/read
+
+# nanoseconds now
+now() { date +%s%N; }
+
+# bench name script units count options...
+# Run i2cio with options on the named script and print the elapsed time and
+# rate. If count is "output" then it's the number of bytes output.
+bench()
+{
+    name=$1 script=$2 units=$3 count=$4
+    shift 4
+    t0=$(now)
+    "$i2cio" "$@" < $dir/$script > $dir/out
+    t1=$(now)
+    [ "$count" = output ] && count=$(wc -c < $dir/out)
+    awk -v name="$name" -v script="$script" -v units="$units" -v count="$count" -v ns=$((t1 - t0)) 'BEGIN {
+        printf "{\"bench\": \"%s\", \"script\": \"%s\", \"seconds\": %.6f, \"%s\": %d, \"%s_per_sec\": %.0f}\n",
+            name, script, ns / 1e9, units, count, units, count * 1e9 / ns }'
+}
+
+# parse rate, compiling to /dev/null
+for s in small huge hex switch comment; do
+    bench parse $s bytes $(wc -c < $dir/$s) -c $dir/$s -o /dev/null
+done
+
+# output formatting rate, as output bytes per second
+bench format.hex read bytes output -n
+bench format.decimal read bytes output -n -d
+bench format.binary read bytes output -n -b
+
+# end-to-end transactions per second
+bench simulated small transactions 200000 -m $sim
+bench simulated huge transactions 4000 -m $sim
+bench simulated hex transactions 4000 -m $sim
+bench simulated switch transactions 200000 -m $sim
+bench simulated.parallel switch transactions 200000 -m $sim -j
+"$i2cio" -c $dir/small -o $dir/small.i2cb
+bench compiled small transactions 200000 -m $sim -x $dir/small.i2cb
+tail -c +9 $dir/small.i2cb > $dir/small.raw
+bench streamed small.raw transactions 200000 -m $sim -B
+
+# a -B frame with M after a write must be rejected, not performed as a write:
+# tag 1, bus 0, 2 messages, W 0x10 0x00 then M 0x10 0xFF 0x0F to 0x50
+printf '\001\000\000\000\000\000\002\000\120\000\000\000\002\000\000\000\120\000\000\001\003\000\000\000\020\000\020\377\017\000\000\000' > $dir/badm.raw
+if "$i2cio" -m $sim -B < $dir/badm.raw 2>/dev/null; then echo "M after a write was accepted" >&2; exit 1; fi
@@ -3,22 +3,58 @@
 //
 // See https://github.com/glitchub/i2cio for more information.
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <poll.h>
 #include <sys/ioctl.h>
-#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <time.h>
+#include <endian.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
+#include "sim.h"
 
 #define MAXMSGS I2C_RDWR_IOCTL_MAX_MSGS // max messages per transaction
-#define MAXLEN 256                      // max message length
+#define MAXFRAME (MAXMSGS + 1)          // and with the mux select that may lead them
+#define MAXLEN 65535                    // max message length
+#define I2C_M_MODIFY 0x0100             // private message flag for M, never passed to the kernel
+#define I2C_M_SELECT 0x0080             // private message flag for mux channel select, likewise
+#define ARENA (MAXMSGS * 256)           // initial size of message arena
+#define MINCHUNK 32                     // smallest chunk when splitting messages
+#define MAXCHUNK 8192                   // longest message i2c-dev accepts, else EINVAL
+#define FORMAT 256                      // bytes formatted at a time
+#define OUTRING (1 << 20)               // output ring bytes for -F, a power of 2
+#define RING 64                         // transactions parsed ahead with -q
+#define BUSYMS 20                       // how long an EEPROM may NAK during its write cycle
+#define POLLUS 100                      // pause between polls of a busy EEPROM
+#define MAXREQ 4096                     // max size of client request
+#define INSIZE 65536                    // initial size of input buffer
+#define BINMAGIC 0x62633269             // compiled script magic, "i2cb" in little-endian
+#define BINVERSION 1                    // compiled script version
+#define PREFAULT 65536                  // stack to pre-fault for -L
+#define BUCKETS 8                       // latency histogram buckets per power of two
+#define NBUCKETS (62 * BUCKETS)         // enough for any 64-bit nanosecond count
 
 #define die(...) fprintf(stderr,__VA_ARGS__), exit(1)
+#define fail(...) return fprintf(stderr,__VA_ARGS__), 1
+#define reject(...) { fprintf(stderr,__VA_ARGS__); goto rejected; } // only in process()
 
 #define usage() die("Usage:\n\
 \n\
@@ -34,9 +70,23 @@ of numeric fields.\n\
 \n\
     D addr bus        - specify the 7-bit I2C address and bus number for\n\
                         subsequent R and W operations.\n\
-    R length          - where length is 1-256, read specified number of bytes.\n\
+    D addr bus/mux@chan - likewise for a device behind channel chan (0-7) of\n\
+                        the PCA9548-style mux at address mux on the bus. The\n\
+                        channel is selected by a separate write before each\n\
+                        transaction, unless it is known to be selected\n\
+                        already. Muxes only switch at STOP, so the select\n\
+                        can't be part of the transaction. Any other mux on\n\
+                        the bus left with a channel open is closed first.\n\
+    R length          - where length is 1-65535, read specified number of bytes.\n\
     W byte [... byte] - where N's are numeric values 0-255, write specified\n\
-                        bytes. Up to 256 bytes may be specified.\n\
+                        bytes. Up to 65535 bytes may be specified.\n\
+    W x\"hex\"          - write bytes given as pairs of hex digits, e.g.\n\
+                        x\"DEADBEEF\". May be mixed with byte values.\n\
+    W @file ofs len   - write len bytes read from file at offset ofs. May be\n\
+                        mixed with byte values. Not with -C.\n\
+    M reg mask value  - read register reg, replace the bits set in mask with\n\
+                        those in value and write it back. This is performed\n\
+                        by itself, not as part of a transaction.\n\
     ;                 - end the current transaction, next R or W starts a new\n\
                         one.\n\
     # ...             - ignore text to end of line (aka a comment)\n\
@@ -56,59 +106,1791 @@ binary instead.\n\
 \n\
 If the -n option is given, then a dry run is performed. The specified I2C\n\
 device will not be opened and read command results will report as 0x55's.\n\
-", MAXMSGS)
+\n\
+If the -S path option is given, i2cio runs as a server on the named unix\n\
+socket. Clients are served one at a time and I2C devices stay open between\n\
+them. The -L, -P, -A, -t and -m options apply to the server as a whole, so\n\
+are only accepted when it starts, not from clients.\n\
+\n\
+If the -C path option is given, i2cio hands its stdin, stdout, stderr and\n\
+other options to the server on the named unix socket, which performs the\n\
+transactions on its behalf. The exit status is the server's.\n\
+\n\
+If the -i option is given, i2cio runs interactively for use as a coprocess.\n\
+Each transaction is followed by a status line, either \"OK\" or \"ERR errno\",\n\
+and output is flushed. Errors discard the current transaction and the rest of\n\
+the line, but do not stop processing.\n\
+\n\
+If the -k option is given, a failed transaction does not stop processing.\n\
+Instead it outputs a line of the form \"ERR errno line N addr A bus B\",\n\
+where N is the line on which the transaction started. The number of failed\n\
+transactions is reported on completion and the exit status is non-zero.\n\
+\n\
+If the -f script option is given, commands are read from the named file\n\
+instead of stdin. Commands read from a regular file, either way, are parsed\n\
+directly from a memory mapping of it.\n\
+\n\
+If the -c script option is given, commands are read from the named file and\n\
+compiled to a binary form, which is written to stdout. No I2C devices are\n\
+accessed. If the -x compiled option is given, transactions are read from the\n\
+named compiled file and performed without any parsing. The -o file option\n\
+writes output to the named file instead of stdout.\n\
+\n\
+If the -B option is given, stdin is a stream of binary transactions, each\n\
+performed as soon as it has arrived. The format is that of a compiled script\n\
+without its 8-byte header, all fields little-endian:\n\
+\n\
+    u32 tag, u16 bus, u16 nmsgs    - tag is reported in place of a line number\n\
+    nmsgs * u16 addr, u16 flags,   - flags 1 to read, else 0 to write\n\
+            u16 len, u16 0\n\
+    data for each write message    - in order, then 0-3 zeros to align to 4\n\
+\n\
+Use -b to get read data back in binary.\n\
+\n\
+If the -s option is given, all commands are parsed and checked before any\n\
+transaction is performed. All errors are reported, and if there are any then\n\
+nothing is performed. Compiling with -c also reports all errors.\n\
+\n\
+If the -j option is given, transactions for each bus are performed by a\n\
+separate thread, so different buses run concurrently. Transactions on the\n\
+same bus are performed in script order, and read data is output in script\n\
+order once all are done. This implies -s, and also applies to -x.\n\
+\n\
+If the -q option is given, commands are parsed by a separate thread up to %d\n\
+transactions ahead of the one being performed, so parsing overlaps the time\n\
+spent waiting for the bus. Output is unchanged. Not with -i.\n\
+\n\
+If the -r addr:bus[/mux@chan][,addr:bus...] option is given, registers of the\n\
+listed devices are cached. M uses the cached value of a register instead of\n\
+reading it, once it is known. Any other write to the device discards its\n\
+cache. A server keeps the cache for all its clients. Devices behind different\n\
+mux channels are distinct for -r, -e and -t.\n\
+\n\
+If the -e option is given, the data written to each device by a transaction\n\
+that is just a write of a register number and at least one byte is\n\
+remembered, and a later identical write to the same register is skipped. This\n\
+assumes devices auto-increment the register for each byte. Any other write\n\
+to the device, or a failed one, forgets what it overlaps or everything. A\n\
+server remembers writes for all its clients, and forgets them on writes by\n\
+clients without -e too. M skips the write if the register is read and\n\
+already holds the new value. Skipped writes are reported with -v.\n\
+\n\
+If the -F option is given, read data is passed raw to a separate thread to be\n\
+formatted and written, so the thread performing transactions only waits for\n\
+output if the %d KiB ring between them is full. The ring's high-water mark\n\
+is reported with -v. Not with -i or -j.\n\
+\n\
+If the -p interval[,count] option is given, the script is parsed once and then\n\
+performed every interval, count times or forever. The interval is a number\n\
+with suffix s, ms, us or ns, default ms. Each sample starts with a line of\n\
+the form \"@ seconds\" giving the CLOCK_MONOTONIC time, unless -b is given.\n\
+Missed deadlines are reported to stderr and skipped. This implies -s, and\n\
+also applies to -x.\n\
+\n\
+If the -E addr:bus:pagesize:addrbytes option is given, stdin is a binary image\n\
+to be programmed into the EEPROM at addr on bus, starting at its address 0.\n\
+The image is written a page at a time, each page is followed by polling the\n\
+device with a zero-length write, or an address write if the adapter can't do\n\
+that, until it ACKs the end of its write cycle. Addrbytes is 1 or 2, address\n\
+overflow goes to the low bits of addr as used by 1-byte parts over 256 bytes.\n\
+\n\
+For real-time use, the -A cpus option sets the CPU affinity to the given list,\n\
+e.g. \"0,2-3\", the -P priority option selects SCHED_FIFO scheduling with the\n\
+given priority 1-99, and the -L option locks all memory and pre-faults the\n\
+message buffers. What was applied is reported to stderr at startup.\n\
+\n\
+Messages longer than 8192 bytes, the most i2c-dev accepts, are split into\n\
+chunks, reads as consecutive reads and writes continued with I2C_M_NOSTART.\n\
+Messages longer than the adapter accepts are retried split into smaller\n\
+chunks, and the size that works is remembered for the bus. Writes are only\n\
+split if the adapter supports I2C_M_NOSTART, else they fail.\n\
+\n\
+If the -a bytes option is given, devices are assumed to be EEPROM-style with\n\
+the given number of address bytes, 1 or 2. A transaction that writes address\n\
+and data, writes an address and reads, or just reads is split into as few\n\
+separate transactions as the adapter allows, each addressing the byte where\n\
+the last left off, and retried while the device NAKs during a write cycle.\n\
+The adapter's read and write limits are found by trial on first use and\n\
+remembered for the bus.\n\
+\n\
+If the -t option is given, the time taken by each I2C_RDWR is measured and\n\
+the count, minimum, median, 99th and 99.9th percentile, and maximum latency\n\
+and throughput for each device are reported to stderr on exit, and on SIGUSR1\n\
+with -p or -S. A server accumulates them over all clients.\n\
+\n\
+If the -m devices option is given, a simulated bus is used instead of\n\
+/dev/i2c-N. Devices is a comma-separated list of \"type:bus:addr\" or\n\
+\"type:bus:addr:mux:chan\" for a device behind a mux, where type is one of\n\
+24c01 to 24c512, lm75 or pca9548. Also \"byte=ns\" sets the bus time per byte\n\
+and \"cycle=ns\" sets the EEPROM write cycle time. \"max=len\" limits the\n\
+message length the simulated adapter accepts, \"maxread=len\" and\n\
+\"maxwrite=len\" just reads or writes, and \"nostart=0\" makes it lack\n\
+I2C_M_NOSTART. For example:\n\
+\n\
+    -m pca9548:1:0x70,24c02:1:0x50:0x70:3,lm75:1:0x48,byte=90000\n\
+\n\
+If the -v option is given, statistics are reported to stderr on completion.\n\
+", MAXMSGS, RING, OUTRING / 1024)
+
+bool dryrun, decimal, binary, verbose, interactive, keepgoing; // options, reset for each client
+bool compiling, precompiled, validate, parallel, streaming, pipelined, formatting, eliding; // -c, -x, -s, -j, -B, -q, -F and -e, also reset for each client
+struct timespec period;                 // sampling period for -p, zero if not sampling
+unsigned long samples;                  // number of samples, 0 = forever
+unsigned int addrbytes;                 // -a, EEPROM address bytes or 0
+struct { unsigned int addr, bus, page, abytes; } image; // -E, EEPROM to program, page 0 if not
+char *server, *client;                  // socket paths for -S and -C
+char *script;                           // script path for -f, -c or -x
+char *output;                           // output path for -o
+bool lockmem;                           // -L, lock and pre-fault memory
+int priority;                           // -P, SCHED_FIFO priority or 0
+char *cpus;                             // -A, CPU list for affinity
+bool timing;                            // -t, latency statistics for the life of the process
+char *simspec;                          // -m, simulated devices
+bool serving;                           // set once the server runs, -S, -L, -P, -A, -t and -m are then refused
+
+// Register cache for one device, for -r
+struct shadow
+{
+    unsigned int bus, route, addr;      // the device, route as per i2croute
+    bool valid[256];                    // true if the register value is known
+    unsigned char value[256];           // and what it is
+};
+
+struct shadow *shadows;                 // cacheable devices, for the life of the process
+int nshadows;
+
+// Data last written to a device, for -e
+struct memo
+{
+    unsigned int bus, route, addr;      // the device, route as per i2croute
+    struct
+    {
+        uint16_t len;                   // bytes, 0 if unknown
+        unsigned char *data;            // written to registers starting here
+    } reg[256];
+};
+
+struct memo **memos;                    // devices written, for the life of the process
+int nmemos;
+pthread_mutex_t memolock = PTHREAD_MUTEX_INITIALIZER; // may be threaded
+
+// Latency statistics for one device
+struct latency
+{
+    unsigned int bus, route, addr;      // the device, route as per i2croute
+    unsigned long count;                // transactions
+    uint64_t min, max, total;           // nanoseconds
+    uint64_t bytes;                     // bytes transferred
+    uint32_t hist[NBUCKETS];            // log-bucketed histogram
+};
+
+struct latency *latencies;              // all devices seen
+int nlatencies;                         // number of latencies
+pthread_mutex_t latlock = PTHREAD_MUTEX_INITIALIZER; // may be threaded
+volatile sig_atomic_t dump;             // set by SIGUSR1
+
+// Compiled script header, this and the following are little-endian
+struct binhead
+{
+    uint32_t magic;                     // BINMAGIC
+    uint32_t version;                   // BINVERSION
+};
+
+// Compiled transaction, followed by nmsgs struct binmsg, then the data for each
+// write message in order, then padding to a multiple of 4 bytes
+struct bintrans
+{
+    uint32_t line;                      // script line where the transaction started
+    uint16_t bus;                       // I2C bus number
+    uint16_t nmsgs;                     // number of messages
+};
+
+// Compiled message
+struct binmsg
+{
+    uint16_t addr;                      // as per struct i2c_msg
+    uint16_t flags;
+    uint16_t len;
+    uint16_t pad;
+};
+
+// Handler for each parsed transaction, normally transact()
+typedef int handler(struct i2c_msg *msgs, int nmsgs, int line, FILE *out);
+
+struct i2c_msg msgs[MAXFRAME];          // the largest possible transaction
+// Growable buffer for message data
+struct arena
+{
+    unsigned char *buf;
+    size_t size;
+};
+
+struct arena arena;                     // data for msgs[], each message follows the last
+__thread struct arena scratch;          // -a write pieces, per thread for -j
+
+// Input character classes. Whitespace maps to ' ', end of line (including
+// comment) to '\n', digits to '0', commands to their uppercase form and
+// anything else to 0.
+const char cclass[256] =
+{
+    [' '] = ' ', ['\t'] = ' ', ['\v'] = ' ', ['\f'] = ' ', ['\r'] = ' ',
+    ['\n'] = '\n', ['#'] = '\n', [0] = '\n',
+    ['0' ... '9'] = '0',
+    ['D'] = 'D', ['d'] = 'D',
+    ['R'] = 'R', ['r'] = 'R',
+    ['W'] = 'W', ['w'] = 'W',
+    [';'] = ';',
+    ['X'] = 'X', ['x'] = 'X',
+    ['@'] = '@',
+    ['M'] = 'M', ['m'] = 'M',
+};
+
+// Digit values for hex, decimal and octal, 16 if not a digit
+const unsigned char digits[256] =
+{
+    [0 ... 255] = 16,
+    ['0'] = 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+    ['A'] = 10, 11, 12, 13, 14, 15,
+    ['a'] = 10, 11, 12, 13, 14, 15,
+};
+
+// Script input state
+struct input
+{
+    int fd;                             // read from here
+    char *map;                          // or the mapped file, if not NULL
+    size_t start;                       // offset of next line in inbuf or map
+    size_t have;                        // bytes in inbuf or map
+    bool eof;                           // no more to read
+};
+
+// Decimal text for each byte value with trailing space, length in the last byte
+char decbyte[256][5];
+
+char *inbuf;                            // input buffer, reused
+size_t insize;                          // and its size
+
+__thread int i2cfd = -1;                // current I2C bus file descriptor (/dev/i2c-X)
+__thread int i2cbus = -1;               // and its bus number
+__thread unsigned int i2croute;         // and the mux address << 8 | control value to reach the device, 0 if none
+
+// What is known of an adapter's message length limit
+struct limit
+{
+    unsigned int ok;                    // longest length known to work
+    unsigned int bad;                   // shortest length known to fail, or MAXCHUNK+1
+};
+
+// An I2C bus
+struct bus
+{
+    int fd;                             // open handle, or -1
+    unsigned int chunk;                 // longest message the adapter accepts, as far as we know
+    bool nostart;                       // adapter supports I2C_M_NOSTART, so writes can be split
+    struct limit rd, wr;                // read and write limits found with -a
+    int16_t mux[128];                   // control register of each mux, or -1 if unknown
+};
+
+struct bus *buses;                      // indexed by bus number
+unsigned int nbuses;                    // size of buses[]
+
+struct
+{
+    int opened;                         // buses opened
+    int reused;                         // D commands satisfied from buses[]
+    int failed;                         // failed transactions
+    int cached;                         // M reads satisfied from the register cache
+    int elided;                         // writes skipped by -e
+    int selects;                        // mux channel selects written
+    int selected;                       // and skipped because already selected
+    unsigned long missed;               // missed sample deadlines
+} stats;                                // reset for each client
+
+// Parse "interval[,count]" into period and samples, where interval has suffix
+// s, ms, us or ns (default ms). Return false if invalid.
+bool setperiod(char *s)
+{
+    static const struct { char *suffix; unsigned long long ns; } units[] =
+        { { "s", 1000000000 }, { "ms", 1000000 }, { "", 1000000 }, { "us", 1000 }, { "ns", 1 } };
+
+    char *end;
+    unsigned long long N = strtoull(s, &end, 10);
+    size_t len = strcspn(end, ",");
+    int u = 0;
+    while (u < 5 && (strlen(units[u].suffix) != len || strncmp(end, units[u].suffix, len))) u++;
+    if (end == s || u == 5) return false;
+    N *= units[u].ns;
+    if (!N) return false;
+    period.tv_sec = N / 1000000000;
+    period.tv_nsec = N % 1000000000;
+
+    samples = 0;
+    if (end[len] == ',')
+    {
+        s = end + len + 1;
+        samples = strtoul(s, &end, 10);
+        if (end == s || *end || !samples) return false;
+    }
+    return true;
+}
+
+// Parse "addr:bus:pagesize:addrbytes" into image, return false if invalid
+bool setimage(char *s)
+{
+    unsigned long f[4];
+    for (int n = 0; n < 4; n++)
+    {
+        char *end;
+        f[n] = strtoul(s, &end, 0);
+        if (end == s || *end != (n < 3 ? ':' : 0)) return false;
+        s = end + 1;
+    }
+    if (f[0] > 127 || !f[2] || f[2] > MAXLEN - 2 || f[3] < 1 || f[3] > 2) return false;
+    image.addr = f[0];
+    image.bus = f[1];
+    image.page = f[2];
+    image.abytes = f[3];
+    return true;
+}
+
+// Parse "addr:bus[/mux@chan][,addr:bus...]" and add the devices to shadows[]
+// unless already there, return false if invalid
+bool setcache(char *s)
+{
+    while (1)
+    {
+        char *end;
+        unsigned long addr = strtoul(s, &end, 0), bus, route = 0;
+        if (end == s || *end != ':' || addr > 127) return false;
+        s = end + 1;
+        bus = strtoul(s, &end, 0);
+        if (end == s) return false;
+        if (*end == '/')
+        {
+            unsigned long mux, chan;
+            s = end + 1;
+            mux = strtoul(s, &end, 0);
+            if (end == s || *end != '@' || mux > 127) return false;
+            s = end + 1;
+            chan = strtoul(s, &end, 0);
+            if (end == s || chan > 7) return false;
+            route = mux << 8 | 1 << chan;
+        }
+        if (*end && *end != ',') return false;
+
+        int n = 0;
+        while (n < nshadows && (shadows[n].bus != bus || shadows[n].route != route || shadows[n].addr != addr)) n++;
+        if (n == nshadows)
+        {
+            struct shadow *sh = realloc(shadows, (nshadows + 1) * sizeof(*sh));
+            if (!sh) die("realloc failed: %s\n", strerror(errno));
+            shadows = sh;
+            sh[nshadows++] = (struct shadow){ .bus = bus, .route = route, .addr = addr };
+        }
+
+        if (!*end) return true;
+        s = end + 1;
+    }
+}
+
+// Parse a CPU list such as "0,2-3" into set, return false if invalid
+bool cpulist(char *s, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (1)
+    {
+        char *end;
+        unsigned long first = strtoul(s, &end, 10), last = first;
+        if (end == s) return false;
+        if (*end == '-')
+        {
+            s = end + 1;
+            last = strtoul(s, &end, 10);
+            if (end == s || last < first) return false;
+        }
+        if (last >= CPU_SETSIZE) return false;
+        while (first <= last) CPU_SET(first++, set);
+        if (!*end) return true;
+        if (*end != ',') return false;
+        s = end + 1;
+    }
+}
+
+// Apply -A, -P and -L options and report them to stderr. Call after all
+// buffers are allocated.
+void realtime(void)
+{
+    if (!cpus && !priority && !lockmem) return;
+
+    if (cpus)
+    {
+        cpu_set_t set;
+        if (!cpulist(cpus, &set)) die("Invalid CPU list: %s\n", cpus);
+        if (sched_setaffinity(0, sizeof(set), &set)) die("sched_setaffinity failed: %s\n", strerror(errno));
+    }
+
+    if (priority)
+    {
+        struct sched_param sp = { .sched_priority = priority };
+        if (priority < sched_get_priority_min(SCHED_FIFO) || priority > sched_get_priority_max(SCHED_FIFO))
+            die("Invalid priority: %d\n", priority);
+        if (sched_setscheduler(0, SCHED_FIFO, &sp)) die("sched_setscheduler failed: %s\n", strerror(errno));
+    }
+
+    if (lockmem)
+    {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE)) die("mlockall failed: %s\n", strerror(errno));
+        // touch the buffers and some stack so they are resident before the first transaction
+        memset(arena.buf, 0, arena.size);
+        memset(inbuf, 0, insize);
+        volatile char stack[PREFAULT];
+        memset((char *)stack, 0, sizeof(stack));
+    }
+
+    fprintf(stderr, "Real-time: CPUs %s, ", cpus ?: "any");
+    if (priority) fprintf(stderr, "SCHED_FIFO priority %d, ", priority);
+    else fprintf(stderr, "default scheduling, ");
+    fprintf(stderr, "memory %slocked\n", lockmem ? "" : "not ");
+}
+
+// Parse command line options, return false if invalid
+bool options(char **argv)
+{
+    dryrun = decimal = binary = verbose = interactive = keepgoing = false;
+    compiling = precompiled = validate = parallel = streaming = pipelined = formatting = eliding = false;
+    period = (struct timespec){ 0 };
+    addrbytes = 0;
+    image.page = 0;
+    while (*argv)
+    {
+        char *o = *argv++;
+        if (*o != '-') return false;
+        while (*++o) switch(*o)
+        {
+            case 'b': binary = true; break;
+            case 'd': decimal = true; break;
+            case 'i': interactive = true; break;
+            case 'k': keepgoing = true; break;
+            case 'n': dryrun = true; break;
+            case 'v': verbose = true; break;
+            case 'S': if (serving || !*argv) return false; server = *argv++; break;
+            case 'C': if (!*argv) return false; client = *argv++; break;
+            case 'f': if (!*argv) return false; script = *argv++; break;
+            case 'c': if (!*argv) return false; script = *argv++; compiling = true; break;
+            case 'x': if (!*argv) return false; script = *argv++; precompiled = true; break;
+            case 's': validate = true; break;
+            case 'j': parallel = true; break;
+            case 'B': streaming = true; break;
+            case 'q': pipelined = true; break;
+            case 'F': formatting = true; break;
+            case 'e': eliding = true; break;
+            case 'r': if (!*argv || !setcache(*argv++)) return false; break;
+            case 'L': if (serving) return false; lockmem = true; break;
+            case 't': if (serving) return false; timing = true; break;
+            case 'm': if (serving || !*argv) return false; simspec = *argv++; break;
+            case 'P': if (serving || !*argv) return false; priority = atoi(*argv++); break;
+            case 'A': if (serving || !*argv) return false; cpus = *argv++; break;
+            case 'p': if (!*argv || !setperiod(*argv++)) return false; break;
+            case 'o': if (!*argv) return false; output = *argv++; break;
+            case 'E': if (!*argv || !setimage(*argv++)) return false; break;
+            case 'a': if (!*argv || (addrbytes = atoi(*argv++)) < 1 || addrbytes > 2) return false; break;
+            default: return false;
+        }
+    }
+    return true;
+}
+
+// Open /dev/i2c-<bus>, return file descriptor or -1 with errno set
+int devopen(unsigned int bus)
+{
+    char name[32];
+    sprintf(name, "/dev/i2c-%u", bus);
+    return open(name, O_RDWR | O_CLOEXEC);
+}
+
+// Return the I2C_FUNC_* bits of an open I2C bus, 0 if unknown
+unsigned long devfuncs(int fd)
+{
+    unsigned long funcs;
+    return ioctl(fd, I2C_FUNCS, &funcs) < 0 ? 0 : funcs;
+}
+
+// Perform messages on an open I2C bus
+int devtransfer(int fd, struct i2c_msg *msgs, int nmsgs)
+{
+    struct i2c_rdwr_ioctl_data transaction = { .msgs = msgs, .nmsgs = nmsgs };
+    return ioctl(fd, I2C_RDWR, &transaction);
+}
+
+// I2C transport, the kernel's i2c-dev or the simulator
+struct backend
+{
+    int (*open)(unsigned int bus);      // return a handle for the bus, or -1 with errno set
+    unsigned long (*funcs)(int handle); // as per the I2C_FUNCS ioctl
+    int (*transfer)(int handle, struct i2c_msg *msgs, int nmsgs); // as per the I2C_RDWR ioctl
+} devbus = { devopen, devfuncs, devtransfer }, simbus = { simopen, simfuncs, simtransfer }, *backend = &devbus;
+
+// Return the handle for /dev/i2c-<bus>, opening it on first use and keeping it
+// open for the life of the process. Return -1 with errno set on failure.
+int busfd(unsigned int bus)
+{
+    if (bus < nbuses && buses[bus].fd >= 0)
+    {
+        stats.reused++;
+        return buses[bus].fd;
+    }
+
+    int fd = backend->open(bus);
+    if (fd < 0) return -1;
+
+    if (bus >= nbuses)
+    {
+        struct bus *b = realloc(buses, (bus + 1) * sizeof(*b));
+        if (!b) die("realloc failed: %s\n", strerror(errno));
+        for (; nbuses <= bus; nbuses++)
+        {
+            b[nbuses] = (struct bus){ .fd = -1, .chunk = MAXCHUNK, .rd.bad = MAXCHUNK + 1, .wr.bad = MAXCHUNK + 1 };
+            memset(b[nbuses].mux, -1, sizeof(b[nbuses].mux));
+        }
+        buses = b;
+    }
+    stats.opened++;
+    buses[bus].nostart = backend->funcs(fd) & I2C_FUNC_NOSTART;
+    return buses[bus].fd = fd;
+}
+
+// Grow arena a to at least size bytes, and move the buffers of the nmsgs msgs
+// that point into it
+void grow(struct arena *a, size_t size, struct i2c_msg *msgs, int nmsgs)
+{
+    size_t ofs[MAXFRAME];
+    for (int n = 0; n < nmsgs; n++) ofs[n] = msgs[n].buf - a->buf;
+
+    size_t s = a->size ?: ARENA;
+    while (s < size) s *= 2;
+    unsigned char *b = realloc(a->buf, s);
+    if (!b) die("realloc failed: %s\n", strerror(errno));
+    a->buf = b;
+    a->size = s;
+
+    for (int n = 0; n < nmsgs; n++) msgs[n].buf = b + ofs[n];
+}
+
+// Perform messages on the current bus with messages longer than max split into
+// chunks, reads into consecutive reads and writes into a write followed by
+// I2C_M_NOSTART continuations. Return as per I2C_RDWR.
+int chunked(struct i2c_msg *msgs, int nmsgs, unsigned int max)
+{
+    struct i2c_msg split[MAXMSGS];
+    int nsplit = 0;
+    for (int n = 0; n < nmsgs; n++)
+    {
+        unsigned int ofs = 0;
+        do
+        {
+            if (nsplit == MAXMSGS)
+            {
+                errno = E2BIG;
+                return -1;
+            }
+            split[nsplit] = msgs[n];
+            split[nsplit].buf += ofs;
+            split[nsplit].len = msgs[n].len - ofs < max ? msgs[n].len - ofs : max;
+            if (ofs && !(msgs[n].flags & I2C_M_RD)) split[nsplit].flags |= I2C_M_NOSTART;
+            ofs += split[nsplit++].len;
+        } while (ofs < msgs[n].len);
+    }
+    return backend->transfer(i2cfd, split, nsplit);
+}
+
+// With -a, return true if messages are an EEPROM write (W address data), random
+// read (W address, R length) or current address read (R length)
+bool eeprom(struct i2c_msg *msgs, int nmsgs)
+{
+    if (nmsgs == 1) return msgs[0].flags & I2C_M_RD || msgs[0].len > addrbytes;
+    return nmsgs == 2 && !(msgs[0].flags & I2C_M_RD) && msgs[0].len == addrbytes && msgs[1].flags & I2C_M_RD;
+}
+
+// Return true if the last transfer failed because the device NAKed, as adapters
+// report with ENXIO, EREMOTEIO or EIO, after pausing POLLUS before the caller
+// polls it again
+bool busy(void)
+{
+    int err = errno;
+    if (err != ENXIO && err != EREMOTEIO && err != EIO) return false;
+    nanosleep(&(struct timespec){ .tv_nsec = POLLUS * 1000 }, NULL);
+    errno = err;
+    return true;
+}
+
+// Perform an EEPROM transaction as per eeprom() split into pieces that fit the
+// adapter's limits, each addressing the byte after the last. The kernel rejects
+// a message that exceeds a limit with EOPNOTSUPP before touching the bus, so
+// limits are found by trying lengths between the longest known to work and the
+// shortest known to fail, making progress all the while. Pieces are retried
+// while the device NAKs, as it does during the write cycle after a previous
+// piece or transaction. Write data may be read-only, as when it's mapped from a
+// compiled script, so write pieces are assembled in a separate buffer. Return
+// as per I2C_RDWR.
+int pieces(struct i2c_msg *msgs, int nmsgs)
+{
+    struct i2c_msg *data = &msgs[nmsgs - 1], piece[2];
+    bool reading = data->flags & I2C_M_RD;
+    struct limit *l = reading ? &buses[i2cbus].rd : &buses[i2cbus].wr;
+    unsigned int head = reading ? 0 : addrbytes; // address bytes leading each piece
+    unsigned int total = data->len - head, done = 0;
+
+    // the starting address, if there is one
+    unsigned char *abuf = reading ? (nmsgs == 2 ? msgs[0].buf : NULL) : data->buf, addr[2];
+    unsigned long start = 0;
+    for (int i = 0; abuf && i < addrbytes; i++) start = (start << 8) | abuf[i];
+
+    while (done < total)
+    {
+        unsigned int len = total - done;
+        if (head + len >= l->bad)
+        {
+            if (l->bad <= head + 1)
+            {
+                errno = EOPNOTSUPP;
+                return -1;
+            }
+            unsigned int try = l->ok + 1 >= l->bad ? l->ok : (l->ok + l->bad) / 2;
+            len = (try > head ? try : head + 1) - head;
+        }
+
+        // address overflow goes to the low bits of the device address, as used
+        // by 1-byte parts over 256 bytes
+        unsigned long a = start + done;
+        for (int i = addrbytes - 1; i >= 0; i--, a >>= 8) addr[i] = a;
+        unsigned int device = data->addr + (abuf ? a : 0);
+
+        int n = 0;
+        if (reading)
+        {
+            if (abuf) piece[n++] = (struct i2c_msg){ .addr = device, .flags = 0, .len = addrbytes, .buf = addr };
+            piece[n++] = (struct i2c_msg){ .addr = device, .flags = data->flags, .len = len, .buf = data->buf + done };
+        }
+        else
+        {
+            if (scratch.size < head + len) grow(&scratch, head + len, NULL, 0);
+            memcpy(scratch.buf, addr, head);
+            memcpy(scratch.buf + head, data->buf + head + done, len);
+            piece[n++] = (struct i2c_msg){ .addr = device, .flags = data->flags, .len = head + len, .buf = scratch.buf };
+        }
+
+        int r;
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        while ((r = backend->transfer(i2cfd, piece, n)) < 0 && busy())
+        {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            if ((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000 >= BUSYMS) break;
+        }
+
+        if (r < 0)
+        {
+            if (errno != EOPNOTSUPP || head + len >= l->bad) return -1;
+            l->bad = head + len;
+            continue;
+        }
+        if (head + len > l->ok) l->ok = head + len;
+        done += len;
+    }
+    return nmsgs;
+}
+
+// Perform messages on the current bus, split into chunks of at most MAXCHUNK
+// bytes as i2c-dev requires. If the adapter rejects long messages with
+// EOPNOTSUPP then retry with them split into ever smaller chunks, down to
+// MINCHUNK, and remember the size that works for the bus. Writes are only split
+// if the adapter supports I2C_M_NOSTART, else they fail with EOPNOTSUPP, since
+// a new START would make the device take the next chunk's first bytes as an
+// address. Return as per I2C_RDWR.
+int transfer(struct i2c_msg *msgs, int nmsgs)
+{
+    if (addrbytes && eeprom(msgs, nmsgs)) return pieces(msgs, nmsgs);
+
+    struct bus *b = &buses[i2cbus];
+    unsigned int longest = 0, longwrite = 0;
+    for (int n = 0; n < nmsgs; n++)
+    {
+        if (msgs[n].len > longest) longest = msgs[n].len;
+        if (!(msgs[n].flags & I2C_M_RD) && msgs[n].len > longwrite) longwrite = msgs[n].len;
+    }
+
+    while (1)
+    {
+        if (longwrite > b->chunk && !b->nostart)
+        {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        int r = longest > b->chunk ? chunked(msgs, nmsgs, b->chunk) : backend->transfer(i2cfd, msgs, nmsgs);
+        if (r >= 0 || errno != EOPNOTSUPP || longest <= MINCHUNK || b->chunk <= MINCHUNK) return r;
+        b->chunk = (longest < b->chunk ? longest : b->chunk) / 2;
+        if (b->chunk < MINCHUNK) b->chunk = MINCHUNK;
+    }
+}
+
+// Output ring from the thread performing transactions to the formatter thread,
+// for -F. The ring holds records, each a struct outrec and its data. Each side
+// owns its index, and only waits on a semaphore when the ring is empty or full.
+struct
+{
+    FILE *out;                          // formatter output, NULL if not running
+    unsigned char *buf;                 // OUTRING bytes
+    size_t head, tail;                  // total bytes queued and consumed
+    size_t highwater;                   // most bytes queued at once
+    unsigned long stalls;               // times the ring was full
+    bool waiting;                       // set while waiting for space
+    sem_t ready, space;                 // records queued, space freed while waiting
+    pthread_t thread;
+} outq;
+
+// Output ring record
+struct outrec
+{
+    uint32_t kind;                      // OUTDATA, OUTTEXT or OUTEND
+    uint32_t len;                       // bytes that follow
+};
+enum { OUTDATA, OUTTEXT, OUTEND };
+
+// Report statistics to stderr if verbose
+void report(void)
+{
+    if (!verbose) return;
+    // each reuse saves an open() and close()
+    fprintf(stderr, "Buses opened: %d, reused: %d, syscalls saved: %d\n", stats.opened, stats.reused, stats.reused * 2);
+    if (period.tv_sec || period.tv_nsec) fprintf(stderr, "Missed deadlines: %lu\n", stats.missed);
+    for (unsigned int n = 0; n < nbuses; n++)
+        if (buses[n].rd.bad <= MAXCHUNK || buses[n].wr.bad <= MAXCHUNK)
+            fprintf(stderr, "Bus %u limits: longest read %u, longest write %u\n", n, buses[n].rd.ok, buses[n].wr.ok);
+    if (nshadows) fprintf(stderr, "Register cache hits: %d\n", stats.cached);
+    if (eliding) fprintf(stderr, "Writes elided: %d\n", stats.elided);
+    if (stats.selects || stats.selected) fprintf(stderr, "Mux selects: %d, skipped: %d\n", stats.selects, stats.selected);
+    if (outq.highwater) fprintf(stderr, "Output ring high-water: %zu of %d bytes, full %lu times\n", outq.highwater, OUTRING, outq.stalls);
+}
+
+// Format len bytes as space-separated hex or decimal text, return the text
+// length. Text must have room for 5 characters per byte.
+size_t format(unsigned char *buf, int len, char *text)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char *p = text;
+    if (decimal)
+        for (int i = 0; i < len; i++)
+        {
+            memcpy(p, decbyte[buf[i]], 4); // the text and maybe some junk
+            p += decbyte[buf[i]][4];
+        }
+    else
+        for (int i = 0; i < len; i++)
+        {
+            p[0] = '0';
+            p[1] = 'x';
+            p[2] = hex[buf[i] >> 4];
+            p[3] = hex[buf[i] & 15];
+            p[4] = ' ';
+            p += 5;
+        }
+    return p - text;
+}
+
+// Return the histogram bucket for ns. Below 2*BUCKETS buckets are linear, above
+// that there are BUCKETS per power of two.
+int bucket(uint64_t ns)
+{
+    if (ns < BUCKETS) return ns;
+    int msb = 63 - __builtin_clzll(ns);
+    return (msb - 2) * BUCKETS + ((ns >> (msb - 3)) & (BUCKETS - 1));
+}
+
+// Return the largest value in histogram bucket b
+uint64_t bucketmax(int b)
+{
+    if (b < BUCKETS) return b;
+    int shift = b / BUCKETS - 1;
+    return ((uint64_t)(BUCKETS + b % BUCKETS + 1) << shift) - 1;
+}
+
+// Record an I2C_RDWR that took ns nanoseconds to transfer bytes
+void record(unsigned int bus, unsigned int route, unsigned int addr, uint64_t ns, unsigned int bytes)
+{
+    pthread_mutex_lock(&latlock);
+    struct latency *l = latencies;
+    while (l < latencies + nlatencies && (l->bus != bus || l->route != route || l->addr != addr)) l++;
+    if (l == latencies + nlatencies)
+    {
+        if (!(latencies = realloc(latencies, ++nlatencies * sizeof(*latencies)))) die("realloc failed: %s\n", strerror(errno));
+        l = &latencies[nlatencies - 1];
+        memset(l, 0, sizeof(*l));
+        l->bus = bus;
+        l->route = route;
+        l->addr = addr;
+        l->min = UINT64_MAX;
+    }
+    l->count++;
+    if (ns < l->min) l->min = ns;
+    if (ns > l->max) l->max = ns;
+    l->total += ns;
+    l->bytes += bytes;
+    l->hist[bucket(ns)]++;
+    pthread_mutex_unlock(&latlock);
+}
+
+// Return the q quantile of latency l, by nearest rank
+uint64_t quantile(struct latency *l, double q)
+{
+    unsigned long want = q * l->count, seen = 0;
+    if (want < q * l->count || want < 1) want++; // ceil(q * count), at least 1
+    for (int b = 0; b < NBUCKETS; b++)
+        if ((seen += l->hist[b]) >= want)
+            return bucketmax(b) < l->max ? bucketmax(b) : l->max;
+    return l->max;
+}
+
+// Report latency statistics for each device to stderr, in microseconds
+void latreport(void)
+{
+    pthread_mutex_lock(&latlock);
+    for (struct latency *l = latencies; l < latencies + nlatencies; l++)
+    {
+        fprintf(stderr, "Bus %u addr 0x%.02X", l->bus, l->addr);
+        if (l->route) fprintf(stderr, " via 0x%.02X ctrl 0x%.02X", l->route >> 8, l->route & 255);
+        fprintf(stderr, ": count %lu min %.1f p50 %.1f p99 %.1f p99.9 %.1f max %.1f us, %.0f bytes/sec\n",
+                l->count, l->min / 1e3, quantile(l, .5) / 1e3, quantile(l, .99) / 1e3,
+                quantile(l, .999) / 1e3, l->max / 1e3, l->total ? l->bytes * 1e9 / l->total : 0);
+    }
+    pthread_mutex_unlock(&latlock);
+    dump = 0;
+}
+
+// SIGUSR1 handler
+void sigusr1(int sig)
+{
+    dump = 1;
+}
+
+// Interactive status line
+void status(FILE *out, int err)
+{
+    if (err) fprintf(out, "ERR %d\n", err);
+    else fprintf(out, "OK\n");
+    fflush(out);
+}
+
+// Return the register cache for device addr reached by route on bus, or NULL if
+// not cacheable
+struct shadow *shadow(unsigned int bus, unsigned int route, unsigned int addr)
+{
+    for (int n = 0; n < nshadows; n++)
+        if (shadows[n].bus == bus && shadows[n].route == route && shadows[n].addr == addr) return &shadows[n];
+    return NULL;
+}
+
+// Return the memo for device addr reached by route on bus, creating it if need
+// be and create is set, else NULL if none
+struct memo *memo(unsigned int bus, unsigned int route, unsigned int addr, bool create)
+{
+    struct memo *m = NULL;
+    pthread_mutex_lock(&memolock);
+    for (int n = 0; n < nmemos && !m; n++)
+        if (memos[n]->bus == bus && memos[n]->route == route && memos[n]->addr == addr) m = memos[n];
+    if (!m && create)
+    {
+        struct memo **mm = realloc(memos, (nmemos + 1) * sizeof(*mm));
+        if (!mm || !(m = calloc(1, sizeof(*m)))) die("malloc failed: %s\n", strerror(errno));
+        m->bus = bus;
+        m->route = route;
+        m->addr = addr;
+        memos = mm;
+        memos[nmemos++] = m;
+    }
+    pthread_mutex_unlock(&memolock);
+    return m;
+}
+
+// Forget data written to registers first to last of memo m
+void forget(struct memo *m, unsigned int first, unsigned int last)
+{
+    for (unsigned int r = 0; r < 256; r++)
+        if (m->reg[r].len && r <= last && r + m->reg[r].len - 1 >= first)
+        {
+            free(m->reg[r].data);
+            m->reg[r].len = 0;
+        }
+}
+
+// Perform write message w, of a register number and data, on the current bus.
+// With -e, skip it if the same data was the last written to the register.
+// Return as per I2C_RDWR.
+int elide(struct i2c_msg *w)
+{
+    unsigned int reg = w->buf[0], len = w->len - 1;
+    if (!eliding)
+    {
+        // another client may have -e
+        struct memo *m = nmemos ? memo(i2cbus, i2croute, w->addr, false) : NULL;
+        if (m) forget(m, reg, reg + len - 1);
+        return transfer(w, 1);
+    }
+
+    struct memo *m = memo(i2cbus, i2croute, w->addr, true);
+    if (m->reg[reg].len == len && !memcmp(m->reg[reg].data, w->buf + 1, len))
+    {
+        __atomic_add_fetch(&stats.elided, 1, __ATOMIC_RELAXED); // may be threaded
+        return 1;
+    }
+
+    forget(m, reg, reg + len - 1);
+    int r = transfer(w, 1);
+    if (r >= 0 && (m->reg[reg].data = malloc(len)))
+    {
+        memcpy(m->reg[reg].data, w->buf + 1, len);
+        m->reg[reg].len = len;
+    }
+    return r;
+}
+
+// Perform the M command in message m, on the current bus. With -e, the write
+// is skipped if a value just read is unchanged. Return as per I2C_RDWR.
+int modify(struct i2c_msg *m)
+{
+    unsigned char reg = m->buf[0], mask = m->buf[1], value = m->buf[2], old;
+    struct shadow *s = shadow(i2cbus, i2croute, m->addr);
+    bool read = false;                  // true if old was read from the device
+
+    if (s && s->valid[reg])
+    {
+        old = s->value[reg];
+        __atomic_add_fetch(&stats.cached, 1, __ATOMIC_RELAXED); // may be threaded
+    }
+    else
+    {
+        struct i2c_msg rd[2] = { { .addr = m->addr, .len = 1, .buf = &reg }, { .addr = m->addr, .flags = I2C_M_RD, .len = 1, .buf = &old } };
+        if (transfer(rd, 2) < 0) return -1;
+        read = true;
+    }
+
+    unsigned char data[2] = { reg, (old & ~mask) | (value & mask) };
+    struct i2c_msg wr = { .addr = m->addr, .len = 2, .buf = data };
+    int r = 1;
+    if (read && eliding) forget(memo(i2cbus, i2croute, m->addr, true), reg, reg); // the device, not the memo, says what it holds
+    if (read && eliding && data[1] == old) __atomic_add_fetch(&stats.elided, 1, __ATOMIC_RELAXED); // may be threaded
+    else r = elide(&wr);
+    if (s)
+    {
+        s->valid[reg] = r >= 0;
+        s->value[reg] = data[1];
+    }
+    return r < 0 ? -1 : 1;
+}
+
+// Perform messages on the current bus, or an M command, after the mux channel
+// select that may lead them. A write to a cacheable device other than by M
+// discards its register cache, and a single write message goes via elide().
+// Return as per I2C_RDWR.
+int rdwr(struct i2c_msg *msgs, int nmsgs)
+{
+    struct bus *b = &buses[i2cbus];
+    i2croute = msgs->flags & I2C_M_SELECT ? msgs->addr << 8 | msgs->buf[0] : 0;
+    if (msgs->flags & I2C_M_SELECT)
+    {
+        if (b->mux[msgs->addr] == msgs->buf[0]) __atomic_add_fetch(&stats.selected, 1, __ATOMIC_RELAXED); // may be threaded
+        else
+        {
+            // close any other mux that may have a channel open, in case they
+            // are in parallel and a device on one would collide with another
+            static unsigned char none = 0;
+            for (int a = 0; a < 128; a++)
+                if (a != msgs->addr && b->mux[a] > 0)
+                {
+                    struct i2c_msg off = { .addr = a, .len = 1, .buf = &none };
+                    if (transfer(&off, 1) < 0)
+                    {
+                        b->mux[a] = -1;
+                        return -1;
+                    }
+                    b->mux[a] = 0;
+                    __atomic_add_fetch(&stats.selects, 1, __ATOMIC_RELAXED);
+                }
+
+            struct i2c_msg sel = { .addr = msgs->addr, .len = 1, .buf = msgs->buf };
+            if (transfer(&sel, 1) < 0)
+            {
+                b->mux[msgs->addr] = -1;
+                return -1;
+            }
+            b->mux[msgs->addr] = msgs->buf[0];
+            __atomic_add_fetch(&stats.selects, 1, __ATOMIC_RELAXED);
+        }
+        msgs++;
+        nmsgs--;
+    }
+
+    if (msgs->flags & I2C_M_MODIFY) return modify(msgs);
+
+    struct shadow *s = nshadows ? shadow(i2cbus, i2croute, msgs->addr) : NULL;
+    bool data = false;                  // true if any register data is written
+    for (int n = 0; n < nmsgs; n++)
+        if (!(msgs[n].flags & I2C_M_RD))
+        {
+            b->mux[msgs[n].addr] = -1;  // in case it's a mux
+            if (s) memset(s->valid, 0, sizeof(s->valid));
+            if (msgs[n].len > 1) data = true;
+        }
+
+    if (nmsgs == 1 && data) return elide(msgs);
+    if (data && nmemos)
+    {
+        struct memo *m = memo(i2cbus, i2croute, msgs->addr, false);
+        if (m) forget(m, 0, 255);
+    }
+    return transfer(msgs, nmsgs);
+}
+
+// Write len bytes of read data to out, raw or formatted
+void emit(FILE *out, unsigned char *buf, int len)
+{
+    if (binary)
+        // write raw data
+        fwrite(buf, 1, len, out);
+    else
+    {
+        // write formatted data
+        char text[FORMAT * 5];
+        for (int i = 0; i < len; i += FORMAT)
+            fwrite(text, 1, format(buf + i, len - i < FORMAT ? len - i : FORMAT, text), out);
+        fputc('\n', out);
+    }
+}
+
+// Copy len bytes between p and the output ring at ofs, wrapping as needed
+void ringcopy(size_t ofs, void *p, size_t len, bool in)
+{
+    ofs &= OUTRING - 1;
+    size_t first = OUTRING - ofs < len ? OUTRING - ofs : len;
+    if (in)
+    {
+        memcpy(outq.buf + ofs, p, first);
+        memcpy(outq.buf, (char *)p + first, len - first);
+    }
+    else
+    {
+        memcpy(p, outq.buf + ofs, first);
+        memcpy((char *)p + first, outq.buf, len - first);
+    }
+}
+
+// Queue a record for the formatter thread, waiting if the ring is full
+void queue(int kind, void *data, size_t len)
+{
+    struct outrec r = { .kind = kind, .len = len };
+    size_t need = sizeof(r) + len;
+    while (OUTRING - (outq.head - __atomic_load_n(&outq.tail, __ATOMIC_ACQUIRE)) < need)
+    {
+        outq.stalls++;
+        __atomic_store_n(&outq.waiting, true, __ATOMIC_SEQ_CST);
+        if (OUTRING - (outq.head - __atomic_load_n(&outq.tail, __ATOMIC_SEQ_CST)) < need) while (sem_wait(&outq.space));
+    }
+    ringcopy(outq.head, &r, sizeof(r), true);
+    ringcopy(outq.head + sizeof(r), data, len, true);
+
+    // before the formatter can take it
+    size_t used = outq.head + need - __atomic_load_n(&outq.tail, __ATOMIC_RELAXED);
+    if (used > outq.highwater) outq.highwater = used;
+
+    __atomic_store_n(&outq.head, outq.head + need, __ATOMIC_RELEASE);
+    sem_post(&outq.ready);
+}
+
+// Formatter thread, format and write records from the output ring until
+// OUTEND. Output is flushed whenever the ring is empty.
+void *formatter(void *arg)
+{
+    unsigned char *data = malloc(MAXLEN);
+    if (!data) die("malloc failed: %s\n", strerror(errno));
+    while (1)
+    {
+        if (__atomic_load_n(&outq.head, __ATOMIC_ACQUIRE) == outq.tail) fflush(outq.out);
+        while (sem_wait(&outq.ready));
+
+        struct outrec r;
+        ringcopy(outq.tail, &r, sizeof(r), false);
+        ringcopy(outq.tail + sizeof(r), data, r.len, false);
+        __atomic_store_n(&outq.tail, outq.tail + sizeof(r) + r.len, __ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&outq.waiting, false, __ATOMIC_SEQ_CST)) sem_post(&outq.space);
+
+        if (r.kind == OUTEND) break;
+        if (r.kind == OUTTEXT) fwrite(data, 1, r.len, outq.out);
+        else emit(outq.out, data, r.len);
+    }
+    free(data);
+    return NULL;
+}
+
+// Start the formatter thread writing to out
+void startfmt(FILE *out)
+{
+    if (!outq.buf && !(outq.buf = malloc(OUTRING))) die("malloc failed: %s\n", strerror(errno));
+    outq.head = outq.tail = outq.highwater = outq.stalls = 0;
+    outq.waiting = false;
+    sem_init(&outq.ready, 0, 0);
+    sem_init(&outq.space, 0, 0);
+    outq.out = out;
+    if ((errno = pthread_create(&outq.thread, NULL, formatter, NULL))) die("pthread_create failed: %s\n", strerror(errno));
+}
+
+// Stop the formatter thread once it has written everything
+void stopfmt(void)
+{
+    queue(OUTEND, NULL, 0);
+    pthread_join(outq.thread, NULL);
+    sem_destroy(&outq.ready);
+    sem_destroy(&outq.space);
+    outq.out = NULL;
+}
+
+// Output read data to out, via the formatter thread if it's running
+void putdata(FILE *out, unsigned char *buf, int len)
+{
+    if (out == outq.out) queue(OUTDATA, buf, len);
+    else emit(out, buf, len);
+}
+
+// Output formatted text to out, via the formatter thread if it's running
+void puttext(FILE *out, char *fmt, ...)
+{
+    char text[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (len >= sizeof(text)) len = sizeof(text) - 1;
+    if (out == outq.out) queue(OUTTEXT, text, len);
+    else fwrite(text, 1, len, out);
+}
+
+// Perform an I2C transaction that started on the specified script line and
+// output received data, return 1 on failure
+int transact(struct i2c_msg *msgs, int nmsgs, int line, FILE *out)
+{
+    struct timespec t0, t1;
+    if (timing) clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+    if (!dryrun && rdwr(msgs, nmsgs) < 0)
+    {
+        int err = errno;
+        fprintf(stderr, "I2C_RDWR ioctl failed: %s\n", strerror(err));
+        if (!interactive && !keepgoing) return 1;
+        __atomic_add_fetch(&stats.failed, 1, __ATOMIC_RELAXED); // may be threaded
+        if (!keepgoing) status(out, err);
+        else
+        {
+            puttext(out, "ERR %d line %d addr 0x%.02X bus %d\n", err, line, msgs[nmsgs-1].addr, i2cbus);
+            if (interactive) fflush(out);
+        }
+        return 0;
+    }
+    if (timing && !dryrun)
+    {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+        unsigned int bytes = 0;
+        for (int n = 0; n < nmsgs; n++) bytes += msgs[n].len;
+        record(i2cbus, i2croute, msgs[nmsgs-1].addr, (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec, bytes);
+    }
+    for (int n = 0; n < nmsgs; n++)
+    {
+        if (msgs[n].flags & I2C_M_RD)
+        {
+            if (dryrun) memset(msgs[n].buf, 0x55, msgs[n].len); // fake it if dryrun
+            putdata(out, msgs[n].buf, msgs[n].len);
+        }
+    }
+    if (interactive) status(out, 0);
+    return 0;
+}
+
+// Resize the input buffer
+void growin(size_t size)
+{
+    char *b = realloc(inbuf, size);
+    if (!b) die("realloc failed: %s\n", strerror(errno));
+    inbuf = b;
+    insize = size;
+}
+
+// Return the next line of input, always terminated with '\n', or NULL at end
+// of input or on error (with errno set). The line remains valid until the
+// next call.
+char *nextline(struct input *in)
+{
+    if (in->map)
+    {
+        if (in->start == in->have) return errno = 0, NULL;
+        char *line = in->map + in->start;
+        size_t len = in->have - in->start;
+        char *nl = memchr(line, '\n', len);
+        if (nl)
+        {
+            in->start = nl - in->map + 1;
+            return line;
+        }
+
+        // copy the last line to inbuf so it can be terminated
+        if (len >= insize) growin(len + 1);
+        memcpy(inbuf, line, len);
+        inbuf[len] = '\n';
+        in->start = in->have;
+        return inbuf;
+    }
+
+    while (1)
+    {
+        char *nl = memchr(inbuf + in->start, '\n', in->have - in->start);
+        if (nl)
+        {
+            char *line = inbuf + in->start;
+            in->start = nl - inbuf + 1;
+            return line;
+        }
+
+        if (in->eof)
+        {
+            if (in->start == in->have) return errno = 0, NULL;
+            // terminate the last line, there is always room
+            char *line = inbuf + in->start;
+            inbuf[in->have++] = '\n';
+            in->start = in->have;
+            return line;
+        }
+
+        // move partial line to the front and read more
+        in->have -= in->start;
+        memmove(inbuf, inbuf + in->start, in->have);
+        in->start = 0;
+        if (in->have + 1 >= insize) growin(insize * 2);
+
+        ssize_t n = read(in->fd, inbuf + in->have, insize - in->have - 1);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return NULL;
+        }
+        if (!n) in->eof = true;
+        in->have += n;
+    }
+}
+
+// Scan an unsigned number from s in decimal, hex with leading 0x, or octal with
+// leading 0, as per strtoul(). Point *end at the first character after the
+// number. Values too large for an unsigned int return UINT_MAX.
+unsigned int scan(char *s, char **end)
+{
+    unsigned int base = 10;
+    if (*s == '0')
+    {
+        base = 8;
+        if ((s[1] == 'x' || s[1] == 'X') && digits[(unsigned char)s[2]] < 16)
+        {
+            base = 16;
+            s += 2;
+        }
+    }
+
+    unsigned long long N = 0;
+    unsigned int d;
+    while ((d = digits[(unsigned char)*s]) < base)
+    {
+        N = N * base + d;
+        if (N > UINT_MAX) N = UINT_MAX + 1ULL; // saturate, but keep scanning
+        s++;
+    }
+    *end = s;
+    return N > UINT_MAX ? UINT_MAX : N;
+}
+
+// Write a transaction that started on the specified script line to out in
+// compiled form, return 1 on failure
+int compile(struct i2c_msg *msgs, int nmsgs, int line, FILE *out)
+{
+    struct bintrans t = { .line = htole32(line), .bus = htole16(i2cbus), .nmsgs = htole16(nmsgs) };
+    fwrite(&t, sizeof(t), 1, out);
+
+    size_t len = 0;
+    for (int n = 0; n < nmsgs; n++)
+    {
+        struct binmsg m = { .addr = htole16(msgs[n].addr), .flags = htole16(msgs[n].flags), .len = htole16(msgs[n].len) };
+        fwrite(&m, sizeof(m), 1, out);
+    }
+    for (int n = 0; n < nmsgs; n++)
+        if (!(msgs[n].flags & I2C_M_RD))
+        {
+            fwrite(msgs[n].buf, 1, msgs[n].len, out);
+            len += msgs[n].len;
+        }
+    fwrite("\0\0\0", 1, -len & 3, out);
+
+    if (ferror(out)) fail("Output error: %s\n", strerror(errno));
+    return 0;
+}
+
+// Check the compiled script header, return 1 on failure
+int header(char *bin, size_t len)
+{
+    struct binhead h;
+    if (len < sizeof(h) || (memcpy(&h, bin, sizeof(h)), le32toh(h.magic) != BINMAGIC)) fail("Not a compiled script\n");
+    if (le32toh(h.version) != BINVERSION) fail("Unsupported compiled script version %u\n", le32toh(h.version));
+    return 0;
+}
+
+// Decode the compiled transaction at offset *ofs of bin into t and xmsgs and
+// advance *ofs to the next. Write messages point into bin, read messages point
+// into arena a. Return false if corrupt.
+bool decode(char *bin, size_t len, size_t *ofs, struct bintrans *t, struct i2c_msg *xmsgs, struct arena *a)
+{
+    size_t reads = 0;
+    struct binmsg m[MAXFRAME];
+
+    if (len - *ofs < sizeof(*t)) return false;
+    memcpy(t, bin + *ofs, sizeof(*t));
+    t->line = le32toh(t->line);
+    t->bus = le16toh(t->bus);
+    t->nmsgs = le16toh(t->nmsgs);
+    *ofs += sizeof(*t);
+    if (!t->nmsgs || t->nmsgs > MAXFRAME || len - *ofs < t->nmsgs * sizeof(*m)) return false;
+    memcpy(m, bin + *ofs, t->nmsgs * sizeof(*m));
+    *ofs += t->nmsgs * sizeof(*m);
+
+    for (int n = 0; n < t->nmsgs; n++)
+    {
+        m[n].addr = le16toh(m[n].addr);
+        m[n].flags = le16toh(m[n].flags);
+        m[n].len = le16toh(m[n].len);
+        m[n].flags &= I2C_M_RD | I2C_M_MODIFY | I2C_M_SELECT; // others are ignored
+        // M is the only message after any mux select and carries reg, mask and value
+        if (m[n].flags & I2C_M_MODIFY && (m[n].flags != I2C_M_MODIFY || n != !!(m[0].flags & I2C_M_SELECT) || n != t->nmsgs - 1 || m[n].len != 3)) return false;
+        // a mux select is always the first and followed by the device's messages
+        if (m[n].flags & I2C_M_SELECT && (m[n].flags != I2C_M_SELECT || n || t->nmsgs < 2 || m[n].len != 1)) return false;
+        if (m[n].addr > 127 || m[n].len > MAXLEN) return false;
+        xmsgs[n].addr = m[n].addr;
+        xmsgs[n].flags = m[n].flags;
+        xmsgs[n].len = m[n].len;
+        if (m[n].flags & I2C_M_RD)
+        {
+            if (!m[n].len) return false;
+            reads += m[n].len;
+        }
+        else
+        {
+            if (len - *ofs < m[n].len) return false;
+            xmsgs[n].buf = (unsigned char *)bin + *ofs;
+            *ofs += m[n].len;
+        }
+    }
+    if (t->nmsgs > MAXMSGS && !(m[0].flags & I2C_M_SELECT)) return false; // only a select may be extra
+    *ofs += -*ofs & 3;
+    if (*ofs > len) *ofs = len; // the last padding is optional
+
+    if (reads > a->size) grow(a, reads, NULL, 0);
+    reads = 0;
+    for (int n = 0; n < t->nmsgs; n++)
+        if (m[n].flags & I2C_M_RD)
+        {
+            xmsgs[n].buf = a->buf + reads;
+            reads += m[n].len;
+        }
+    return true;
+}
+
+// Perform transactions from a compiled script of len bytes, return 1 on
+// failure. Write data is used in place.
+int replay(char *bin, size_t len, FILE *out)
+{
+    if (header(bin, len)) return 1;
+
+    size_t ofs = sizeof(struct binhead);
+    while (ofs < len)
+    {
+        struct bintrans t;
+        struct i2c_msg xmsgs[MAXFRAME];
+
+        if (!decode(bin, len, &ofs, &t, xmsgs, &arena)) fail("Compiled script is corrupt at offset %zu\n", ofs);
+
+        if (!dryrun && (i2cfd = busfd(t.bus)) < 0)
+            fail("Invalid bus for transaction from line %u (/dev/i2c-%u: %s)\n", t.line, t.bus, strerror(errno));
+        i2cbus = t.bus;
+        if (transact(xmsgs, t.nmsgs, t.line, out)) return 1;
+    }
+    return 0;
+}
+
+// Return the length of the compiled transaction at the start of bin, including
+// padding, or 0 if len isn't enough to tell
+size_t framelen(char *bin, size_t len)
+{
+    struct bintrans t;
+    struct binmsg m;
+    if (len < sizeof(t)) return 0;
+    memcpy(&t, bin, sizeof(t));
+    if (le16toh(t.nmsgs) > MAXFRAME) return sizeof(t); // let decode() reject it now
+    size_t need = sizeof(t) + le16toh(t.nmsgs) * sizeof(m);
+    if (len < need) return 0;
+    for (int n = 0; n < le16toh(t.nmsgs); n++)
+    {
+        memcpy(&m, bin + sizeof(t) + n * sizeof(m), sizeof(m));
+        if (!(le16toh(m.flags) & I2C_M_RD)) need += le16toh(m.len);
+    }
+    return need + (-need & 3);
+}
+
+// Perform compiled transactions from in as they arrive, for -B. Read data goes
+// into inbuf a block at a time, and write data is used in place. Return 1 on
+// failure.
+int stream(struct input *in, FILE *out)
+{
+    size_t done = 0;                    // input consumed
+    while (1)
+    {
+        char *bin = (in->map ?: inbuf) + in->start;
+        size_t have = in->have - in->start, need = framelen(bin, have);
+        if (!need || need > have)
+        {
+            if (!in->map && !in->eof)
+            {
+                // move partial transaction to the front and read more
+                memmove(inbuf, bin, have);
+                in->have = have;
+                in->start = 0;
+                if (need > insize || have == insize) growin(need > insize ? need : insize * 2);
+                ssize_t n = read(in->fd, inbuf + in->have, insize - in->have);
+                if (n < 0 && errno != EINTR) fail("Input error: %s\n", strerror(errno));
+                if (!n) in->eof = true;
+                if (n > 0) in->have += n;
+                continue;
+            }
+            if (!have) return 0;
+            need = have;                // the last, maybe without padding
+        }
+
+        struct bintrans t;
+        struct i2c_msg xmsgs[MAXFRAME];
+        size_t ofs = 0;
+        if (!decode(bin, need, &ofs, &t, xmsgs, &arena)) fail("Binary input is corrupt at offset %zu\n", done);
+        in->start += ofs;
+        done += ofs;
+
+        if (!dryrun && (i2cfd = busfd(t.bus)) < 0)
+            fail("Invalid bus for transaction %u (/dev/i2c-%u: %s)\n", t.line, t.bus, strerror(errno));
+        i2cbus = t.bus;
+        if (transact(xmsgs, t.nmsgs, t.line, out)) return 1;
+    }
+}
+
+// Per-bus worker state for fanout()
+struct worker
+{
+    pthread_t thread;
+    unsigned int bus;                   // the bus to run
+    int fd;                             // and its file descriptor
+    FILE *out;                          // output for this bus
+    char *text;                         // is accumulated here
+    size_t size;                        // this many bytes
+    size_t cursor;                      // merge position in text
+    int status;                         // 1 if a transaction failed
+};
+
+// Shared fanout() state
+struct
+{
+    char *bin;                          // the compiled script
+    size_t len;                         // its length
+    size_t *offsets;                    // offset of each transaction in bin
+    uint16_t *buses;                    // bus of each transaction
+    size_t *ends;                       // end of its output in the worker text, or SIZE_MAX if not done
+    int count;                          // number of transactions
+    bool abort;                         // set when any worker fails
+} fan;
+
+// Worker thread, perform all transactions for one bus in script order
+void *work(void *arg)
+{
+    struct worker *w = arg;
+    struct arena a = { 0 };
+
+    i2cfd = w->fd;
+    i2cbus = w->bus;
 
-bool dryrun = false, decimal = false, binary = false;
+    for (int i = 0; i < fan.count && !__atomic_load_n(&fan.abort, __ATOMIC_RELAXED); i++)
+    {
+        if (fan.buses[i] != w->bus) continue;
+
+        struct bintrans t;
+        struct i2c_msg xmsgs[MAXFRAME];
+        size_t ofs = fan.offsets[i];
+        decode(fan.bin, fan.len, &ofs, &t, xmsgs, &a); // already checked
+
+        if (transact(xmsgs, t.nmsgs, t.line, w->out))
+        {
+            w->status = 1;
+            __atomic_store_n(&fan.abort, true, __ATOMIC_RELAXED);
+            break;
+        }
+        fflush(w->out);
+        fan.ends[i] = w->size;
+    }
+
+    free(a.buf);
+    free(scratch.buf);                  // if -a wrote pieces
+    return NULL;
+}
 
-// Perform an I2C transaction and output received data
-void transact(struct i2c_msg *msgs, int nmsgs, int i2cfd)
+// Perform transactions from a compiled script of len bytes with one thread per
+// bus, each in script order, then output read data in script order. Return 1 on
+// failure.
+int fanout(char *bin, size_t len, FILE *out)
 {
-    struct i2c_rdwr_ioctl_data transaction = { .msgs = msgs, .nmsgs = nmsgs };
-    if (!dryrun && ioctl(i2cfd, I2C_RDWR, &transaction) < 0) die ("I2C_RDWR ioctl failed: %s\n", strerror(errno));
-    for (int n = 0; n < nmsgs; n++)
+    if (header(bin, len)) return 1;
+
+    // index the transactions and find the buses
+    struct worker *workers = NULL;
+    int nworkers = 0, size = 0;
+    memset(&fan, 0, sizeof(fan));
+    fan.bin = bin;
+    fan.len = len;
+
+    for (size_t ofs = sizeof(struct binhead); ofs < len;)
     {
-        if (msgs[n].flags & I2C_M_RD)
+        if (fan.count == size)
         {
-            if (dryrun) memset(msgs[n].buf, 0x55, msgs[n].len); // fake it if dryrun
-            if (binary)
-                // write raw data
-                write(1, msgs[n].buf, msgs[n].len);
-            else
-            {
-                // write formatted data
-                for (int i = 0; i < msgs[n].len; i++) printf(decimal ? "%d " : "0x%.02X ", msgs[n].buf[i]);
-                printf("\n");
-            }
+            size = size ? size * 2 : 256;
+            if (!(fan.offsets = realloc(fan.offsets, size * sizeof(*fan.offsets))) ||
+                !(fan.buses = realloc(fan.buses, size * sizeof(*fan.buses))) ||
+                !(fan.ends = realloc(fan.ends, size * sizeof(*fan.ends))))
+                die("realloc failed: %s\n", strerror(errno));
+        }
+
+        struct bintrans t;
+        struct i2c_msg xmsgs[MAXFRAME];
+        fan.offsets[fan.count] = ofs;
+        if (!decode(bin, len, &ofs, &t, xmsgs, &arena)) fail("Compiled script is corrupt at offset %zu\n", ofs);
+        fan.buses[fan.count] = t.bus;
+        fan.ends[fan.count++] = SIZE_MAX;
+
+        int w = 0;
+        while (w < nworkers && workers[w].bus != t.bus) w++;
+        if (w == nworkers)
+        {
+            if (!(workers = realloc(workers, ++nworkers * sizeof(*workers)))) die("realloc failed: %s\n", strerror(errno));
+            memset(&workers[w], 0, sizeof(*workers));
+            workers[w].bus = t.bus;
+            workers[w].fd = -1;
+            if (!dryrun && (workers[w].fd = busfd(t.bus)) < 0)
+                fail("Invalid bus for transaction from line %u (/dev/i2c-%u: %s)\n", t.line, t.bus, strerror(errno));
         }
     }
+
+    for (int w = 0; w < nworkers; w++)
+    {
+        if (!(workers[w].out = open_memstream(&workers[w].text, &workers[w].size))) die("open_memstream failed: %s\n", strerror(errno));
+        if ((errno = pthread_create(&workers[w].thread, NULL, work, &workers[w]))) die("pthread_create failed: %s\n", strerror(errno));
+    }
+
+    int status = 0;
+    for (int w = 0; w < nworkers; w++)
+    {
+        pthread_join(workers[w].thread, NULL);
+        fflush(workers[w].out);
+        status |= workers[w].status;
+    }
+
+    // merge output in script order, up to the first transaction not performed
+    for (int i = 0; i < fan.count && fan.ends[i] != SIZE_MAX; i++)
+    {
+        struct worker *w = workers;
+        while (w->bus != fan.buses[i]) w++;
+        fwrite(w->text + w->cursor, 1, fan.ends[i] - w->cursor, out);
+        w->cursor = fan.ends[i];
+    }
+
+    for (int w = 0; w < nworkers; w++)
+    {
+        fclose(workers[w].out);
+        free(workers[w].text);
+    }
+    free(workers);
+    free(fan.offsets);
+    free(fan.buses);
+    free(fan.ends);
+    return status;
 }
 
-int main(int argc, char **argv)
+// Perform a compiled script of len bytes every period, return 1 on failure.
+// Samples are timed by a CLOCK_MONOTONIC timerfd. Missed deadlines are
+// reported and skipped, not made up.
+int periodic(char *bin, size_t len, FILE *out)
 {
-    // command line switches
-    while (*++argv)
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd < 0) fail("timerfd_create failed: %s\n", strerror(errno));
+
+    // first sample now
+    struct itimerspec its = { .it_interval = period };
+    clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
     {
-        char *o = *argv;
-        if (*o != '-') usage();
-        while (*++o) switch(*o)
+        close(tfd);
+        fail("timerfd_settime failed: %s\n", strerror(errno));
+    }
+
+    int status = 0;
+    for (unsigned long n = 1; !samples || n <= samples; n++)
+    {
+        uint64_t expired;
+        if (read(tfd, &expired, sizeof(expired)) != sizeof(expired))
         {
-            case 'b': binary = true; break;
-            case 'd': decimal = true; break;
-            case 'n': dryrun = true; break;
-            default: usage();
+            if (errno == EINTR) { n--; continue; }
+            fprintf(stderr, "timerfd read failed: %s\n", strerror(errno));
+            status = 1;
+            break;
+        }
+        if (expired > 1)
+        {
+            fprintf(stderr, "Missed %llu deadline%s before sample %lu\n", (unsigned long long)expired - 1, expired == 2 ? "" : "s", n);
+            stats.missed += expired - 1;
+        }
+
+        if (!binary)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            puttext(out, "@ %lld.%09ld\n", (long long)ts.tv_sec, ts.tv_nsec);
+        }
+        if ((parallel ? fanout : replay)(bin, len, out))
+        {
+            status = 1;
+            break;
         }
+        if (out != outq.out) fflush(out); // else the formatter does
+        if (dump) latreport();
     }
 
-    unsigned int addr = 0;              // current I2C device address
-    int i2cfd = -1;                     // current I2C bus file descriptor (/dev/i2c-X)
+    close(tfd);
+    return status;
+}
+
+// Perform a compiled script of len bytes as per options, return 1 on failure
+int execute(char *bin, size_t len, FILE *out)
+{
+    if (period.tv_sec || period.tv_nsec) return periodic(bin, len, out);
+    return parallel ? fanout(bin, len, out) : replay(bin, len, out);
+}
+
+// Program the image of len bytes into the EEPROM specified by -E, a page at a
+// time. After each page, poll until the device ACKs instead of waiting out the
+// worst case write cycle. Return 0 if programmed, else 1.
+int program(unsigned char *img, size_t len)
+{
+    if (len && image.addr + ((len - 1) >> (8 * image.abytes)) > 127) fail("Image is too large for EEPROM at 0x%02X\n", image.addr);
+    if (!dryrun && (i2cfd = busfd(image.bus)) < 0) fail("Invalid bus %u (/dev/i2c-%u: %s)\n", image.bus, image.bus, strerror(errno));
+    i2cbus = image.bus;
+
+    if (arena.size < image.abytes + image.page) grow(&arena, image.abytes + image.page, NULL, 0);
+    unsigned char *buf = arena.buf;
+    bool zerolen = true;                // poll with zero-length writes until the adapter objects
+    unsigned long pages = 0, polls = 0;
+
+    for (size_t ofs = 0; ofs < len; pages++)
+    {
+        size_t n = image.page - ofs % image.page;
+        if (n > len - ofs) n = len - ofs;
+
+        size_t a = ofs;
+        for (int i = image.abytes - 1; i >= 0; i--, a >>= 8) buf[i] = a;
+        memcpy(buf + image.abytes, img + ofs, n);
+        struct i2c_msg m = { .addr = image.addr + a, .flags = 0, .len = image.abytes + n, .buf = buf };
 
-    struct i2c_msg msgs[MAXMSGS];       // The largest possible transaction
+        if (!dryrun)
+        {
+            if (transfer(&m, 1) < 0) fail("Write to 0x%02X failed at offset %zu: %s\n", m.addr, ofs, strerror(errno));
+
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            while (1)
+            {
+                polls++;
+                m.len = zerolen ? 0 : image.abytes;
+                if (backend->transfer(i2cfd, &m, 1) >= 0) break;
+                if (errno == EOPNOTSUPP && zerolen) zerolen = false;
+                else if (!busy()) fail("Poll of 0x%02X failed at offset %zu: %s\n", m.addr, ofs, strerror(errno));
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                if ((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000 >= BUSYMS)
+                    fail("EEPROM at 0x%02X did not ACK after writing offset %zu\n", m.addr, ofs);
+            }
+        }
+        ofs += n;
+    }
+
+    if (verbose) fprintf(stderr, "Programmed %zu bytes in %lu pages with %lu polls\n", len, pages, polls);
+    return 0;
+}
+
+// Make room in the arena for n more bytes of write message msgs[nmsgs], return
+// false if that would exceed MAXLEN
+bool reserve(unsigned int n, int nmsgs)
+{
+    if (msgs[nmsgs].len + n > MAXLEN) return false;
+    size_t end = msgs[nmsgs].buf - arena.buf + msgs[nmsgs].len + n;
+    if (end > arena.size) grow(&arena, end, msgs, nmsgs + 1);
+    return true;
+}
+
+char *blobpath;                         // file for W @file, kept open for the next one
+int blobfd = -1;
+
+// Open the file named by the len characters at name for W @file, unless it's
+// already open. Return false with errno set if it can't be opened.
+bool blob(char *name, int len)
+{
+    if (blobpath && (int)strlen(blobpath) == len && !memcmp(blobpath, name, len)) return true;
+    char *path = strndup(name, len);
+    if (!path) die("strndup failed: %s\n", strerror(errno));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        free(path);
+        return false;
+    }
+    if (blobfd >= 0) close(blobfd);
+    free(blobpath);
+    blobpath = path;
+    blobfd = fd;
+    return true;
+}
+
+handler enqueue;                        // for -q, doesn't open buses when parsing
+
+// Start a transaction in msgs[] with a write of ctrl to the mux at addr, to
+// select a channel. Return the number of messages.
+int muxselect(unsigned int addr, unsigned char ctrl)
+{
+    arena.buf[0] = ctrl;
+    msgs[0] = (struct i2c_msg){ .addr = addr, .flags = I2C_M_SELECT, .len = 1, .buf = arena.buf };
+    return 1;
+}
 
-    for (int n = 0; n < MAXMSGS; n++)   // Each gets a buffer
-        if (!(msgs[n].buf = malloc(MAXLEN)))
-            die("malloc failed: %s\n", strerror(errno));
+// Parse commands from in and pass each transaction to perform(), return 1 on
+// failure
+int process(struct input *in, handler *perform, FILE *out)
+{
+    char *line;
 
+    unsigned int addr = 0;              // current I2C device address
+    int mux = -1;                       // address of its mux, if any
+    unsigned char chans = 0;            // and the mux control value to select its channel
+    bool selected = false;              // true if addr and bus are valid
+    int first = 0;                      // line where the current transaction started
     int nmsgs = 0;                      // Number of messages in current transaction
+    int errors = 0;                     // rejected commands
 
     // parser state
     enum
@@ -119,26 +1901,29 @@ int main(int argc, char **argv)
         WRITE,      // expecting byte to write
         WRITING,    // expecting byte, D, R, W, ; or EOF
         ADDR,       // expecting device address
-        BUS         // expecting bus number
+        BUS,        // expecting bus number
+        OFFSET,     // expecting @file offset
+        LENGTH,     // expecting @file length
+        MODIFY      // expecting M reg, mask or value
     } state = INIT;
+    unsigned int offset = 0;            // @file offset
 
     int lines = 1;
     while (1)
     {
-        char *line = NULL; size_t size = 0;
-        if (getline(&line, &size, stdin) < 0)
+        if (!(line = nextline(in)))
         {
-            if (errno) die("Input error in line %d: %s\n", lines, strerror(errno));
+            if (errno) fail("Input error in line %d: %s\n", lines, strerror(errno));
             break;
         }
 
         int ofs = 0;
         while (1)
         {
-            while (isspace(line[ofs])) ofs++;
-            if (line[ofs] == 0 || line[ofs] == '#') break;
+            while (cclass[(unsigned char)line[ofs]] == ' ') ofs++;
+            if (cclass[(unsigned char)line[ofs]] == '\n') break;
 
-            switch (toupper(line[ofs]))
+            switch (cclass[(unsigned char)line[ofs]])
             {
                 case 'R':
                     // add read message to transaction
@@ -153,13 +1938,19 @@ int main(int argc, char **argv)
 
                         default:
                         unexpected:
-                            die("Unexpected '%c' at line %d offset %d\n", line[ofs], lines, ofs+1);
+                            reject("Unexpected '%c' at line %d offset %d\n", line[ofs], lines, ofs+1);
                     }
-                    if (nmsgs >= MAXMSGS) die("Max %d messages per transaction\n",MAXMSGS);
+                    if (nmsgs - (nmsgs && mux >= 0) >= MAXMSGS) reject("Max %d messages per transaction\n",MAXMSGS); // not counting the select
 
-                    // init next message
+                    // init next message, its data follows the last
+                    if (!nmsgs)
+                    {
+                        first = lines;
+                        if (mux >= 0) nmsgs = muxselect(mux, chans);
+                    }
                     msgs[nmsgs].addr = addr;
                     msgs[nmsgs].flags = I2C_M_RD;
+                    msgs[nmsgs].buf = nmsgs ? msgs[nmsgs-1].buf + msgs[nmsgs-1].len : arena.buf;
 
                     state = READ;
                     ofs++;
@@ -179,12 +1970,18 @@ int main(int argc, char **argv)
                         default:
                             goto unexpected;
                     }
-                    if (nmsgs >= MAXMSGS) die("Max %d messages per transaction\n",MAXMSGS);
+                    if (nmsgs - (nmsgs && mux >= 0) >= MAXMSGS) reject("Max %d messages per transaction\n",MAXMSGS); // not counting the select
 
-                    // init next message
+                    // init next message, its data follows the last
+                    if (!nmsgs)
+                    {
+                        first = lines;
+                        if (mux >= 0) nmsgs = muxselect(mux, chans);
+                    }
                     msgs[nmsgs].addr = addr;
                     msgs[nmsgs].flags = 0;
                     msgs[nmsgs].len = 0;
+                    msgs[nmsgs].buf = nmsgs ? msgs[nmsgs-1].buf + msgs[nmsgs-1].len : arena.buf;
 
                     state = WRITE;
                     ofs++;
@@ -196,7 +1993,7 @@ int main(int argc, char **argv)
                     {
                         case WRITING:
                             nmsgs++;
-                            transact(msgs, nmsgs, i2cfd);
+                            if (perform(msgs, nmsgs, first, out)) return 1;
                             nmsgs = 0;
                             break;
 
@@ -206,7 +2003,7 @@ int main(int argc, char **argv)
                         case IDLE:
                             if (nmsgs)
                             {
-                                transact(msgs, nmsgs, i2cfd);
+                                if (perform(msgs, nmsgs, first, out)) return 1;
                                 nmsgs = 0;
                             }
                             break; // sugar
@@ -225,7 +2022,7 @@ int main(int argc, char **argv)
                     {
                         case WRITING:
                             nmsgs++;
-                            transact(msgs, nmsgs, i2cfd);
+                            if (perform(msgs, nmsgs, first, out)) return 1;
                             nmsgs = 0;
                             break;
 
@@ -233,54 +2030,131 @@ int main(int argc, char **argv)
                             break;
 
                         case IDLE:
-                            if (nmsgs) transact(msgs, nmsgs, i2cfd);
+                            if (nmsgs)
+                            {
+                                if (perform(msgs, nmsgs, first, out)) return 1;
+                                nmsgs = 0;
+                            }
                             break;
 
                         default:
                             goto unexpected;
                     }
+                    selected = false;
                     state = ADDR;
                     ofs++;
                     break;
 
-                case '0' ... '9':
+                case 'M':
+                    // read-modify-write register, by itself
+                    switch (state)
+                    {
+                        case WRITING:
+                            nmsgs++;
+                            if (perform(msgs, nmsgs, first, out)) return 1;
+                            nmsgs = 0;
+                            break;
+
+                        case IDLE:
+                            if (nmsgs)
+                            {
+                                if (perform(msgs, nmsgs, first, out)) return 1;
+                                nmsgs = 0;
+                            }
+                            break;
+
+                        default:
+                            goto unexpected;
+                    }
+                    first = lines;
+                    if (mux >= 0) nmsgs = muxselect(mux, chans);
+                    msgs[nmsgs].addr = addr;
+                    msgs[nmsgs].flags = I2C_M_MODIFY;
+                    msgs[nmsgs].len = 0;
+                    msgs[nmsgs].buf = nmsgs ? msgs[nmsgs-1].buf + msgs[nmsgs-1].len : arena.buf;
+                    state = MODIFY;
+                    ofs++;
+                    break;
+
+                case '0':
                 {
                     char *end;
-                    unsigned int N = strtoul(line+ofs, &end, 0);
+                    unsigned int N = scan(line+ofs, &end);
 
                     switch (state)
                     {
                         case ADDR:
-                            if (N > 127) die("Device address exceeds 127 at line %d offset %d\n", lines, ofs+1);
+                            if (N > 127) reject("Device address exceeds 127 at line %d offset %d\n", lines, ofs+1);
                             addr = N;
                             state = BUS;
                             break;
 
                         case BUS:
-                            if (!dryrun)
+                            // compiled transactions have 16 bits for it
+                            if (N > 65535) reject("Bus number exceeds 65535 at line %d offset %d\n", lines, ofs+1);
+                            if (!dryrun && !compiling && perform != enqueue && (i2cfd = busfd(N)) < 0)
+                                reject("Invalid bus at line %d offset %d (/dev/i2c-%d: %s)\n", lines, ofs+1, N, strerror(errno));
+                            i2cbus = N;
+                            mux = -1;
+                            if (*end == '/')
                             {
-                                char name[32];
-                                if (i2cfd > 0) close(i2cfd); // close existing
-                                sprintf((char *)&name, "/dev/i2c-%d", N);
-                                i2cfd = open(name, O_RDWR);
-                                if (i2cfd < 0) die("Invalid bus at line %d offset %d (%s: %s)\n", lines, ofs+1, name, strerror(errno));
+                                // the device is behind a mux
+                                char *s = end + 1;
+                                N = scan(s, &end);
+                                if (end == s || N > 127 || *end != '@') reject("Invalid mux address at line %d offset %d\n", lines, (int)(s-line)+1);
+                                mux = N;
+                                s = end + 1;
+                                N = scan(s, &end);
+                                if (end == s || N > 7) reject("Mux channel must be 0 to 7 at line %d offset %d\n", lines, (int)(s-line)+1);
+                                chans = 1 << N;
                             }
+                            selected = true;
                             state = IDLE;
                             break;
 
                          case READ:
-                            if (N < 1 || N > MAXLEN) die("Read length must be 1 to %d at line %d offset %d\n", MAXLEN, lines, ofs+1);
-                            msgs[nmsgs++].len = N;
+                            if (N < 1 || N > MAXLEN) reject("Read length must be 1 to %d at line %d offset %d\n", MAXLEN, lines, ofs+1);
+                            msgs[nmsgs].len = N;
+                            if (msgs[nmsgs].buf - arena.buf + N > arena.size) grow(&arena, msgs[nmsgs].buf - arena.buf + N, msgs, nmsgs + 1);
+                            nmsgs++;
                             state = IDLE;
                             break;
 
                          case WRITE:
                          case WRITING:
-                            if (N > 255) die("Write value exceeds 255 at line %d offset %d\n", lines, ofs+1);
+                            if (N > 255) reject("Write value exceeds 255 at line %d offset %d\n", lines, ofs+1);
+                            if (!reserve(1, nmsgs)) reject("Write length exceeds %d at line %d offset %d\n", MAXLEN, lines, ofs+1);
+                            msgs[nmsgs].buf[msgs[nmsgs].len++] = N;
+                            state = WRITING;
+                            break;
+
+                         case MODIFY:
+                            if (N > 255) reject("Register value exceeds 255 at line %d offset %d\n", lines, ofs+1);
                             msgs[nmsgs].buf[msgs[nmsgs].len++] = N;
-                            if (msgs[nmsgs].len > MAXLEN) die("Write length exceeds %d at line %d offset %d\n", MAXLEN, lines, ofs+1);
+                            if (msgs[nmsgs].len == 3)
+                            {
+                                if (perform(msgs, nmsgs + 1, first, out)) return 1;
+                                nmsgs = 0;
+                                state = IDLE;
+                            }
+                            break;
+
+                         case OFFSET:
+                            offset = N;
+                            state = LENGTH;
+                            break;
+
+                         case LENGTH:
+                         {
+                            if (!N) reject("File length must be at least 1 at line %d offset %d\n", lines, ofs+1);
+                            if (!reserve(N, nmsgs)) reject("Write length exceeds %d at line %d offset %d\n", MAXLEN, lines, ofs+1);
+                            ssize_t got = pread(blobfd, msgs[nmsgs].buf + msgs[nmsgs].len, N, offset);
+                            if (got < 0) reject("Can't read %s at line %d: %s\n", blobpath, lines, strerror(errno));
+                            if (got < N) reject("File %s is too short at line %d offset %d\n", blobpath, lines, ofs+1);
+                            msgs[nmsgs].len += N;
                             state = WRITING;
                             break;
+                         }
 
                          default:
                             goto unexpected;
@@ -289,11 +2163,55 @@ int main(int argc, char **argv)
                     break;
                 }
 
+                case 'X':
+                {
+                    // add hex string to write message
+                    if (state != WRITE && state != WRITING) goto unexpected;
+                    if (line[ofs+1] != '"') reject("Expected '\"' at line %d offset %d\n", lines, ofs+2);
+                    char *hex = line + ofs + 2;
+                    int n = 0;
+                    while (digits[(unsigned char)hex[n]] < 16) n++;
+                    if (hex[n] != '"') reject("Invalid hex string at line %d offset %d\n", lines, ofs+3+n);
+                    if (!n) reject("Empty hex string at line %d offset %d\n", lines, ofs+3);
+                    if (n & 1) reject("Odd number of hex digits at line %d offset %d\n", lines, ofs+3);
+                    if (!reserve(n / 2, nmsgs)) reject("Write length exceeds %d at line %d offset %d\n", MAXLEN, lines, ofs+1);
+                    unsigned char *p = msgs[nmsgs].buf + msgs[nmsgs].len;
+                    for (int i = 0; i < n; i += 2) *p++ = digits[(unsigned char)hex[i]] << 4 | digits[(unsigned char)hex[i+1]];
+                    msgs[nmsgs].len += n / 2;
+                    state = WRITING;
+                    ofs += n + 3;
+                    break;
+                }
+
+                case '@':
+                {
+                    // open file to write from, the path ends with whitespace
+                    if (state != WRITE && state != WRITING) goto unexpected;
+                    // the server would open it with its own permissions
+                    if (server) reject("W @file not allowed for -C clients at line %d offset %d\n", lines, ofs+1);
+                    int n = 1;
+                    while (cclass[(unsigned char)line[ofs+n]] != ' ' && cclass[(unsigned char)line[ofs+n]] != '\n') n++;
+                    if (n == 1 || n > PATH_MAX) reject("Invalid file name at line %d offset %d\n", lines, ofs+2);
+                    if (!blob(line + ofs + 1, n - 1)) reject("Can't open %.*s at line %d offset %d: %s\n", n - 1, line + ofs + 1, lines, ofs+2, strerror(errno));
+                    state = OFFSET;
+                    ofs += n;
+                    break;
+                }
+
                 default:
-                    die ("Invalid '%c' line %d offset %d\n", line[ofs], lines, ofs+1);
+                    reject("Invalid '%c' line %d offset %d\n", line[ofs], lines, ofs+1);
             }
         }
-        free(line);
+        lines++;
+        continue;
+
+      rejected:
+        // discard the current transaction and the rest of the line
+        if (!interactive && !validate && !compiling) return 1;
+        if (interactive) status(out, EINVAL);
+        errors++;
+        nmsgs = 0;
+        state = selected ? IDLE : INIT;
         lines++;
     }
 
@@ -301,16 +2219,381 @@ int main(int argc, char **argv)
     {
         case WRITING:
             nmsgs++;
-            transact(msgs, nmsgs, i2cfd);
+            if (perform(msgs, nmsgs, first, out)) return 1;
             break;
 
         case IDLE:
-            if (nmsgs) transact(msgs, nmsgs, i2cfd);
+            if (nmsgs && perform(msgs, nmsgs, first, out)) return 1;
             break;
 
         default:
-            die("Unexpected end of input\n");
+            if (state == INIT && errors) break; // left by a rejected D, already reported
+            fprintf(stderr, "Unexpected end of input\n");
+            if (interactive) status(out, EINVAL);
+            return 1;
     }
 
+    return errors != 0;
+}
+
+// A parsed transaction waiting to be performed with -q
+struct slot
+{
+    struct i2c_msg msgs[MAXFRAME];      // its messages
+    int nmsgs;                          // how many, 0 at end of input
+    int line;                           // where it started
+    unsigned int bus;                   // where to perform it
+    struct arena data;                  // message data
+};
+
+// Ring of parsed transactions from the parser thread to the performer. Each
+// side has its own index, the semaphores count the free and ready slots and
+// only enter the kernel when one side has to wait for the other.
+struct
+{
+    struct slot slots[RING];
+    sem_t free, ready;
+    unsigned int head, tail;            // next slot to fill and to perform
+    int status;                         // parser's return status
+    bool abort;                         // set when a transaction fails
+} ring;
+
+// Return the next free slot, waiting if there is none
+struct slot *nextfree(void)
+{
+    while (sem_wait(&ring.free));
+    return &ring.slots[ring.head++ % RING];
+}
+
+// Handler for the parser thread, copy the transaction into the next free slot
+int enqueue(struct i2c_msg *msgs, int nmsgs, int line, FILE *out)
+{
+    if (__atomic_load_n(&ring.abort, __ATOMIC_RELAXED)) return 1;
+
+    struct slot *s = nextfree();
+    size_t len = 0;
+    for (int n = 0; n < nmsgs; n++) len += msgs[n].len;
+    if (len > s->data.size) grow(&s->data, len, NULL, 0);
+    len = 0;
+    for (int n = 0; n < nmsgs; n++)
+    {
+        s->msgs[n] = msgs[n];
+        s->msgs[n].buf = s->data.buf + len;
+        if (!(msgs[n].flags & I2C_M_RD)) memcpy(s->msgs[n].buf, msgs[n].buf, msgs[n].len);
+        len += msgs[n].len;
+    }
+    s->nmsgs = nmsgs;
+    s->line = line;
+    s->bus = i2cbus;
+    sem_post(&ring.ready);
     return 0;
 }
+
+// Parser thread, parse commands from arg into the ring, then an end marker
+void *produce(void *arg)
+{
+    ring.status = process(arg, enqueue, NULL);
+    nextfree()->nmsgs = 0;
+    sem_post(&ring.ready);
+    return NULL;
+}
+
+// Perform transactions from in with parsing done by another thread, return 1 on
+// failure. Transactions are performed and output in order until one fails,
+// after which the rest are discarded.
+int pipeline(struct input *in, FILE *out)
+{
+    int status = 0;
+    pthread_t thread;
+
+    ring.head = ring.tail = 0;
+    ring.abort = false;
+    sem_init(&ring.free, 0, RING);
+    sem_init(&ring.ready, 0, 0);
+    if ((errno = pthread_create(&thread, NULL, produce, in))) die("pthread_create failed: %s\n", strerror(errno));
+
+    while (1)
+    {
+        while (sem_wait(&ring.ready));
+        struct slot *s = &ring.slots[ring.tail++ % RING];
+        if (!s->nmsgs) break;
+        if (!status)
+        {
+            if (!dryrun && (i2cfd = busfd(s->bus)) < 0)
+            {
+                fprintf(stderr, "Invalid bus for transaction from line %u (/dev/i2c-%u: %s)\n", s->line, s->bus, strerror(errno));
+                status = 1;
+            }
+            else
+            {
+                i2cbus = s->bus;
+                status = transact(s->msgs, s->nmsgs, s->line, out);
+            }
+            if (status) __atomic_store_n(&ring.abort, true, __ATOMIC_RELAXED);
+        }
+        sem_post(&ring.free);
+    }
+
+    pthread_join(thread, NULL);
+    sem_destroy(&ring.free);
+    sem_destroy(&ring.ready);
+    return status || ring.status;
+}
+
+// Perform transactions for commands read from fd, or compile them, return 1 on
+// failure. If fd is a regular file then it is memory mapped and parsed in
+// place, starting at the current file offset.
+int run(int fd, FILE *out)
+{
+    memset(&stats, 0, sizeof(stats));
+
+    struct input in = { .fd = fd };
+    struct stat st;
+    off_t pos;
+
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && (pos = lseek(fd, 0, SEEK_CUR)) >= 0 && st.st_size > pos)
+    {
+        in.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (in.map == MAP_FAILED) in.map = NULL; // just read it instead
+        else
+        {
+            madvise(in.map, st.st_size, MADV_SEQUENTIAL);
+            in.start = pos;
+            in.have = st.st_size;
+        }
+    }
+
+    bool queued = formatting && !interactive && !parallel && !compiling && !image.page;
+    if (queued) startfmt(out);
+
+    int status;
+    if (streaming) status = stream(&in, out);
+    else if (precompiled || image.page)
+    {
+        status = 0;
+        while (!in.map)
+        {
+            // read it all
+            if (in.have == insize) growin(insize * 2);
+            ssize_t n = read(fd, inbuf + in.have, insize - in.have);
+            if (n < 0 && errno != EINTR)
+            {
+                fprintf(stderr, "Input error: %s\n", strerror(errno));
+                status = 1;
+                break;
+            }
+            if (!n) break;
+            if (n > 0) in.have += n;
+        }
+        if (status);
+        else if (image.page) status = program((unsigned char *)(in.map ?: inbuf) + in.start, in.have - in.start);
+        else status = execute((in.map ?: inbuf) + in.start, in.have - in.start, out);
+    }
+    else if (compiling)
+    {
+        struct binhead h = { .magic = htole32(BINMAGIC), .version = htole32(BINVERSION) };
+        fwrite(&h, sizeof(h), 1, out);
+        status = process(&in, compile, out);
+    }
+    else if (validate || parallel || period.tv_sec || period.tv_nsec)
+    {
+        // compile to memory, then replay only if there were no errors
+        char *bin;
+        size_t len;
+        FILE *mem = open_memstream(&bin, &len);
+        if (!mem) die("open_memstream failed: %s\n", strerror(errno));
+        struct binhead h = { .magic = htole32(BINMAGIC), .version = htole32(BINVERSION) };
+        fwrite(&h, sizeof(h), 1, mem);
+        status = process(&in, compile, mem);
+        if (fclose(mem)) die("Output error: %s\n", strerror(errno));
+        if (status) fprintf(stderr, "No transactions performed\n");
+        else status = execute(bin, len, out);
+        free(bin);
+    }
+    else if (pipelined && !interactive) status = pipeline(&in, out);
+    else status = process(&in, transact, out);
+
+    if (queued) stopfmt();
+    if (in.map) munmap(in.map, in.have);
+    if (blobpath)
+    {
+        // the next client may mean a different file
+        close(blobfd);
+        free(blobpath);
+        blobpath = NULL;
+        blobfd = -1;
+    }
+
+    if (stats.failed && keepgoing) fprintf(stderr, "%d transaction%s failed\n", stats.failed, stats.failed == 1 ? "" : "s");
+    return status || stats.failed;
+}
+
+// Serve client requests on the unix socket at path, forever. A request is a
+// single packet containing the client's NUL-separated command line options,
+// with its stdin, stdout and stderr attached. The response is a single byte
+// exit status.
+void serve(char *path)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(sa.sun_path)) die("Socket path too long: %s\n", path);
+    strcpy(sa.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0) die("socket failed: %s\n", strerror(errno));
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) die("Can't bind %s: %s\n", path, strerror(errno));
+    if (listen(sock, 16) < 0) die("listen failed: %s\n", strerror(errno));
+
+    signal(SIGPIPE, SIG_IGN); // clients may go away at any time
+    serving = true;
+
+    while (1)
+    {
+        // poll() is interrupted by SIGUSR1 even with SA_RESTART
+        if (poll(&(struct pollfd){ .fd = sock, .events = POLLIN }, 1, -1) < 0)
+        {
+            if (errno != EINTR) die("poll failed: %s\n", strerror(errno));
+            if (dump) latreport();
+            continue;
+        }
+
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0)
+        {
+            if (errno == EINTR) continue;
+            die("accept failed: %s\n", strerror(errno));
+        }
+
+        char req[MAXREQ];
+        union { struct cmsghdr h; char buf[CMSG_SPACE(3 * sizeof(int))]; } ctl;
+        struct iovec iov = { .iov_base = req, .iov_len = sizeof(req) - 1 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = &ctl, .msg_controllen = sizeof(ctl) };
+
+        ssize_t len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+        struct cmsghdr *cmsg = len > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+        if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        {
+            close(conn); // not a valid request
+            continue;
+        }
+
+        int fds[3];
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+        // split request into an argv, an empty argument makes it invalid
+        char *args[MAXREQ + 1];
+        int nargs = 0;
+        bool valid = true;
+        req[len] = 0;
+        for (char *s = req; s < req + len; s += strlen(s) + 1)
+        {
+            if (!*s) valid = false;
+            args[nargs++] = s;
+        }
+        args[nargs] = NULL;
+
+        // errors go to the client's stderr for the duration
+        int saved = dup(2);
+        dup2(fds[2], 2);
+        close(fds[2]);
+
+        unsigned char status = 1;
+        FILE *out = fdopen(fds[1], "w");
+        if (!out) fprintf(stderr, "fdopen failed: %s\n", strerror(errno));
+        else if (!valid || !options(args)) fprintf(stderr, "Invalid options\n");
+        else status = run(fds[0], out), report();
+        if (out && fclose(out) && !status) fprintf(stderr, "Output error: %s\n", strerror(errno)), status = 1;
+        if (!out) close(fds[1]);
+        close(fds[0]);
+
+        dup2(saved, 2);
+        close(saved);
+
+        send(conn, &status, 1, MSG_NOSIGNAL);
+        close(conn);
+    }
+}
+
+// Send the command line and stdio to the server at path, return its exit
+// status
+int request(char *path, char **argv)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(sa.sun_path)) die("Socket path too long: %s\n", path);
+    strcpy(sa.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0) die("socket failed: %s\n", strerror(errno));
+    if (connect(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) die("Can't connect to %s: %s\n", path, strerror(errno));
+
+    char req[MAXREQ];
+    size_t len = 0;
+    for (; *argv; argv++)
+    {
+        size_t l = strlen(*argv) + 1;
+        if (len + l >= sizeof(req)) die("Command line too long\n");
+        memcpy(req + len, *argv, l);
+        len += l;
+    }
+
+    union { struct cmsghdr h; char buf[CMSG_SPACE(3 * sizeof(int))]; } ctl;
+    struct iovec iov = { .iov_base = req, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = &ctl, .msg_controllen = sizeof(ctl) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), (int []){ 0, 1, 2 }, 3 * sizeof(int));
+
+    if (sendmsg(sock, &msg, 0) < 0) die("Can't send to %s: %s\n", path, strerror(errno));
+
+    unsigned char status;
+    if (recv(sock, &status, 1, 0) != 1) die("No response from %s\n", path);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    // command line switches
+    if (!options(argv + 1) || (server && client)) usage();
+
+    if (script)
+    {
+        int fd = open(script, O_RDONLY);
+        if (fd < 0) die("Can't open %s: %s\n", script, strerror(errno));
+        if (fd) dup2(fd, 0), close(fd);
+    }
+
+    if (output)
+    {
+        int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) die("Can't open %s: %s\n", output, strerror(errno));
+        if (fd != 1) dup2(fd, 1), close(fd);
+    }
+
+    if (client) return request(client, argv + 1);
+
+    for (int n = 0; n < 256; n++) decbyte[n][4] = sprintf(decbyte[n], "%d ", n);
+
+    if (!(inbuf = malloc(insize = INSIZE))) die("malloc failed: %s\n", strerror(errno));
+
+    grow(&arena, ARENA, NULL, 0);       // message data, grows as needed
+
+    if (simspec)
+    {
+        if (!simconfig(simspec)) die("Invalid simulation: %s\n", simspec);
+        backend = &simbus;
+    }
+
+    if (timing || server) sigaction(SIGUSR1, &(struct sigaction){ .sa_handler = sigusr1, .sa_flags = SA_RESTART }, NULL);
+
+    realtime();
+
+    if (server) serve(server);
+
+    int status = run(0, stdout);
+    report();
+    if (timing) latreport();
+    if (fflush(stdout)) die("Output error: %s\n", strerror(errno));
+    return status;
+}
@@ -0,0 +1,326 @@
+// This software is released as-is into the public domain, as described at
+// https://unlicense.org. Do whatever you like with it.
+//
+// See https://github.com/glitchub/i2cio for more information.
+
+// Simulated I2C buses, see sim.h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/i2c-dev.h>
+#include "sim.h"
+
+#define MAXDEVS 128                     // max simulated devices
+#define MAXMSG 8192                     // longest message i2c-dev accepts
+
+// Device types
+enum { EEPROM, LM75, PCA9548 };
+
+// EEPROM models
+static const struct
+{
+    char *name;
+    unsigned int size;                  // bytes
+    unsigned int page;                  // page size
+    unsigned int abytes;                // address bytes
+} eeproms[] =
+{
+    { "24c01", 128, 8, 1 },
+    { "24c02", 256, 8, 1 },
+    { "24c04", 512, 16, 1 },            // 1-byte parts over 256 bytes use low address bits
+    { "24c08", 1024, 16, 1 },
+    { "24c16", 2048, 16, 1 },
+    { "24c32", 4096, 32, 2 },
+    { "24c64", 8192, 32, 2 },
+    { "24c128", 16384, 64, 2 },
+    { "24c256", 32768, 64, 2 },
+    { "24c512", 65536, 128, 2 },
+};
+
+// A simulated device
+struct device
+{
+    int type;
+    unsigned int bus, addr;             // where it is
+    unsigned int naddrs;                // number of consecutive addresses it answers
+    int mux;                            // index of upstream mux in devs[], or -1
+    unsigned int chan;                  // and its channel
+    unsigned int muxaddr;               // mux address, until resolved
+
+    unsigned int ptr;                   // EEPROM address or LM75 register pointer
+    unsigned char *mem;                 // EEPROM memory
+    unsigned int size, page, abytes;    // EEPROM geometry
+    uint64_t busy;                      // EEPROM write cycle ends, in ns
+    unsigned char regs[4][2];           // LM75 registers
+    unsigned char ctrl;                 // PCA9548 channel enables
+};
+
+static struct device devs[MAXDEVS];
+static int ndevs;
+
+static unsigned long long bytens;       // ns per byte
+static unsigned long long cyclens = 5000000; // EEPROM write cycle ns
+static unsigned long long maxread = 65535, maxwrite = 65535; // longest messages the adapter accepts
+static unsigned long long nostart = 1;  // adapter supports I2C_M_NOSTART
+
+// Return CLOCK_MONOTONIC in ns
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Parse a number, return false if invalid
+static bool number(char *s, unsigned long long *N)
+{
+    char *end;
+    *N = strtoull(s, &end, 0);
+    return end != s && !*end;
+}
+
+bool simconfig(char *spec)
+{
+    char *copy = strdup(spec), *save, *item;
+    if (!copy) return false;
+
+    for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        unsigned long long N;
+        if (!strncmp(item, "byte=", 5))
+        {
+            if (!number(item + 5, &bytens)) goto bad;
+            continue;
+        }
+        if (!strncmp(item, "cycle=", 6))
+        {
+            if (!number(item + 6, &cyclens)) goto bad;
+            continue;
+        }
+        if (!strncmp(item, "max=", 4))
+        {
+            if (!number(item + 4, &maxread) || !maxread) goto bad;
+            maxwrite = maxread;
+            continue;
+        }
+        if (!strncmp(item, "maxread=", 8))
+        {
+            if (!number(item + 8, &maxread) || !maxread) goto bad;
+            continue;
+        }
+        if (!strncmp(item, "nostart=", 8))
+        {
+            if (!number(item + 8, &nostart) || nostart > 1) goto bad;
+            continue;
+        }
+        if (!strncmp(item, "maxwrite=", 9))
+        {
+            if (!number(item + 9, &maxwrite) || !maxwrite) goto bad;
+            continue;
+        }
+
+        if (ndevs == MAXDEVS) goto bad;
+        struct device *d = &devs[ndevs];
+        memset(d, 0, sizeof(*d));
+        d->mux = -1;
+        d->naddrs = 1;
+
+        char *f[5];
+        int nf = 0;
+        for (char *s = item, *sv; nf < 5 && (s = strtok_r(s, ":", &sv)); s = NULL) f[nf++] = s;
+        if (nf != 3 && nf != 5) goto bad;
+
+        if (!strcmp(f[0], "lm75"))
+        {
+            d->type = LM75;
+            memcpy(d->regs, (unsigned char[4][2]){ { 0x19, 0x80 }, { 0 }, { 0x4B, 0 }, { 0x50, 0 } }, sizeof(d->regs)); // 25.5C, 75C, 80C
+        }
+        else if (!strcmp(f[0], "pca9548")) d->type = PCA9548;
+        else
+        {
+            int e = 0;
+            while (e < sizeof(eeproms) / sizeof(*eeproms) && strcmp(f[0], eeproms[e].name)) e++;
+            if (e == sizeof(eeproms) / sizeof(*eeproms)) goto bad;
+            d->type = EEPROM;
+            d->size = eeproms[e].size;
+            d->page = eeproms[e].page;
+            d->abytes = eeproms[e].abytes;
+            if (d->abytes == 1 && d->size > 256) d->naddrs = d->size / 256;
+            if (!(d->mem = malloc(d->size))) goto bad;
+            memset(d->mem, 0xFF, d->size); // erased
+        }
+
+        if (!number(f[1], &N)) goto bad;
+        d->bus = N;
+        if (!number(f[2], &N) || N > 127 || (N & (d->naddrs - 1))) goto bad;
+        d->addr = N;
+        if (nf == 5)
+        {
+            if (!number(f[3], &N) || N > 127) goto bad;
+            d->muxaddr = N;
+            if (!number(f[4], &N) || N > 7) goto bad;
+            d->chan = N;
+            d->mux = MAXDEVS; // resolved below
+        }
+        ndevs++;
+    }
+    free(copy);
+
+    // resolve muxes
+    for (int n = 0; n < ndevs; n++)
+    {
+        if (devs[n].mux < 0) continue;
+        int m = 0;
+        while (m < ndevs && (devs[m].type != PCA9548 || devs[m].bus != devs[n].bus || devs[m].addr != devs[n].muxaddr || m == n)) m++;
+        if (m == ndevs) return false;
+        devs[n].mux = m;
+    }
+    return true;
+
+  bad:
+    free(copy);
+    return false;
+}
+
+int simopen(unsigned int bus)
+{
+    for (int n = 0; n < ndevs; n++) if (devs[n].bus == bus) return bus;
+    errno = ENODEV;
+    return -1;
+}
+
+unsigned long simfuncs(int bus)
+{
+    return I2C_FUNC_I2C | (nostart ? I2C_FUNC_NOSTART : 0);
+}
+
+// Return true if device is reachable, i.e. not behind a disabled mux channel
+static bool reachable(struct device *d)
+{
+    for (int depth = 0; d->mux >= 0; depth++)
+    {
+        struct device *m = &devs[d->mux];
+        if (depth == MAXDEVS || !(m->ctrl & (1 << d->chan))) return false;
+        d = m;
+    }
+    return true;
+}
+
+// Return the device answering addr on bus, or NULL
+static struct device *find(unsigned int bus, unsigned int addr)
+{
+    for (struct device *d = devs; d < devs + ndevs; d++)
+        if (d->bus == bus && addr >= d->addr && addr < d->addr + d->naddrs && reachable(d))
+            return d;
+    return NULL;
+}
+
+int simtransfer(int bus, struct i2c_msg *msgs, int nmsgs)
+{
+    uint64_t start = now(), bytes = 0;
+    struct device *written[I2C_RDWR_IOCTL_MAX_MSGS];
+    int nwritten = 0, n;
+
+    for (n = 0; n < nmsgs; n++) if (msgs[n].len > MAXMSG)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (n = 0; n < nmsgs; n++) if (msgs[n].len > (msgs[n].flags & I2C_M_RD ? maxread : maxwrite))
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    for (n = 0; n < nmsgs; n++)
+    {
+        struct i2c_msg *m = &msgs[n];
+        bytes += 1 + m->len;
+
+        struct device *d = find(bus, m->addr);
+        if (!d || (d->type == EEPROM && d->busy > start)) break; // NAK
+
+        bool reading = m->flags & I2C_M_RD;
+        unsigned char *p = m->buf;
+        unsigned int len = m->len;
+        switch (d->type)
+        {
+            case EEPROM:
+            {
+                unsigned int block = (m->addr - d->addr) << 8;
+                if (reading)
+                    while (len--)
+                    {
+                        *p++ = d->mem[d->ptr];
+                        d->ptr = (d->ptr + 1) % d->size;
+                    }
+                else if (m->flags & I2C_M_NOSTART && n && !(msgs[n-1].flags & I2C_M_RD) && msgs[n-1].addr == m->addr)
+                {
+                    // continues the previous write
+                    if (len && (!nwritten || written[nwritten-1] != d)) written[nwritten++] = d;
+                    while (len--)
+                    {
+                        d->mem[d->ptr] = *p++;
+                        d->ptr = (d->ptr & ~(d->page - 1)) | ((d->ptr + 1) & (d->page - 1));
+                    }
+                }
+                else if (len >= d->abytes)
+                {
+                    d->ptr = 0;
+                    for (int i = 0; i < d->abytes; i++) d->ptr = (d->ptr << 8) | *p++;
+                    d->ptr = (block | d->ptr) % d->size;
+                    len -= d->abytes;
+                    if (len) written[nwritten++] = d;
+                    // data wraps within the page
+                    while (len--)
+                    {
+                        d->mem[d->ptr] = *p++;
+                        d->ptr = (d->ptr & ~(d->page - 1)) | ((d->ptr + 1) & (d->page - 1));
+                    }
+                }
+                break;
+            }
+
+            case LM75:
+                if (!reading && len)
+                {
+                    d->ptr = *p++ & 3;
+                    len--;
+                    for (int i = 0; len && i < (d->ptr == 1 ? 1 : 2); i++, len--)
+                        if (d->ptr) d->regs[d->ptr][i] = *p++;
+                }
+                // reads repeat the register contents
+                for (int i = 0; reading && i < len; i++) p[i] = d->regs[d->ptr][d->ptr == 1 ? 0 : i & 1];
+                break;
+
+            case PCA9548:
+                if (reading) memset(p, d->ctrl, len);
+                else if (len) d->ctrl = p[len - 1];
+                break;
+        }
+    }
+
+    // writes are committed at STOP
+    uint64_t end = start + bytes * bytens;
+    for (int i = 0; i < nwritten; i++) written[i]->busy = end + cyclens;
+
+    // wait out the bus time
+    if (bytens)
+    {
+        struct timespec ts = { .tv_sec = end / 1000000000, .tv_nsec = end % 1000000000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+
+    if (n < nmsgs)
+    {
+        errno = ENXIO;
+        return -1;
+    }
+    return nmsgs;
+}
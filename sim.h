@@ -0,0 +1,37 @@
+// This software is released as-is into the public domain, as described at
+// https://unlicense.org. Do whatever you like with it.
+//
+// See https://github.com/glitchub/i2cio for more information.
+
+// Simulated I2C buses, for testing and benchmarking without hardware
+
+#include <stdbool.h>
+#include <linux/i2c.h>
+
+// Add simulated devices and timing per spec, a comma-separated list of:
+//
+//    type:bus:addr[:mux:chan] - a device of the given type at addr on bus,
+//                               optionally behind channel chan of the
+//                               PCA9548 at address mux on the same bus
+//    byte=ns                  - bus time per byte, including address bytes
+//    cycle=ns                 - EEPROM write cycle time, default 5000000
+//    max=len                  - longest message the adapter accepts, longer
+//                               ones fail with EOPNOTSUPP
+//    maxread=len              - likewise for read messages only
+//    maxwrite=len             - likewise for write messages only
+//    nostart=0                - the adapter doesn't claim I2C_FUNC_NOSTART
+//
+// EEPROM writes flagged I2C_M_NOSTART continue the previous write message.
+// Types are 24c01, 24c02, 24c04, 24c08, 24c16, 24c32, 24c64, 24c128,
+// 24c256 and 24c512 EEPROMs, lm75 temperature sensor and pca9548 mux.
+// Return false if spec is invalid.
+bool simconfig(char *spec);
+
+// Return a handle for simulated bus, or -1 with errno set if it has no devices
+int simopen(unsigned int bus);
+
+// Return the I2C_FUNC_* bits of a simulated bus, as per the I2C_FUNCS ioctl
+unsigned long simfuncs(int handle);
+
+// Perform messages on a simulated bus, as per the I2C_RDWR ioctl
+int simtransfer(int handle, struct i2c_msg *msgs, int nmsgs);